@@ -6,9 +6,17 @@
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
+#ifndef LABHELPER_NO_GL
 #include <GL/glew.h>
+#endif
 #include <stb_image.h>
 
+///////////////////////////////////////////////////////////////////////////
+// With LABHELPER_NO_GL defined, models are only loaded into the CPU
+// buffers (and textures into Texture::data), for programs that run
+// without a GL context. render() is then not available.
+///////////////////////////////////////////////////////////////////////////
+
 namespace labhelper
 {
 bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
@@ -24,6 +32,7 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 		          << "\n";
 		exit(1);
 	}
+#ifndef LABHELPER_NO_GL
 	glGenTextures(1, &gl_id);
 	glBindTexture(GL_TEXTURE_2D, gl_id);
 	GLenum format, internal_format;
@@ -54,6 +63,7 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+#endif
 	return true;
 }
 
@@ -62,6 +72,7 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 ///////////////////////////////////////////////////////////////////////////
 Model::~Model()
 {
+#ifndef LABHELPER_NO_GL
 	for(auto& material : m_materials)
 	{
 		if(material.m_color_texture.valid)
@@ -80,6 +91,7 @@ Model::~Model()
 	glDeleteBuffers(1, &m_positions_bo);
 	glDeleteBuffers(1, &m_normals_bo);
 	glDeleteBuffers(1, &m_texture_coordinates_bo);
+#endif
 }
 
 Model* loadModelFromOBJ(std::string path)
@@ -320,6 +332,7 @@ Model* loadModelFromOBJ(std::string path)
 	///////////////////////////////////////////////////////////////////////
 	// Upload to GPU
 	///////////////////////////////////////////////////////////////////////
+#ifndef LABHELPER_NO_GL
 	glGenVertexArrays(1, &model->m_vaob);
 	glBindVertexArray(model->m_vaob);
 	glGenBuffers(1, &model->m_positions_bo);
@@ -340,6 +353,7 @@ Model* loadModelFromOBJ(std::string path)
 	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
 	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(2);
+#endif
 
 	std::cout << "done.\n";
 	return model;
@@ -462,6 +476,7 @@ void freeModel(Model* model)
 		delete model;
 }
 
+#ifndef LABHELPER_NO_GL
 ///////////////////////////////////////////////////////////////////////
 // Loop through all Meshes in the Model and render them
 ///////////////////////////////////////////////////////////////////////
@@ -523,4 +538,5 @@ void render(const Model* model, const bool submitMaterials)
 		glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
 	}
 }
+#endif
 } // namespace labhelper
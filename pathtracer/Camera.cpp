@@ -0,0 +1,116 @@
+#include "Camera.h"
+#include "sampling.h"
+
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Used to homogenize points transformed with projection matrices
+///////////////////////////////////////////////////////////////////////////
+inline static vec3 homogenize(const vec4& p)
+{
+	return vec3(p * (1.f / p.w));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Find the first pixel's direction and the per-pixel deltas. Only three
+// points are unprojected, the rest is interpolation (which is exact since
+// points on the far plane are an affine function of pixel coordinates).
+///////////////////////////////////////////////////////////////////////////
+void Camera::setup(const mat4& V, const mat4& P, int width, int height, float lens_radius, float focal_distance)
+{
+	const mat4 inverse_V = inverse(V);
+	const mat4 inverse_PV = inverse(P * V);
+	position = vec3(inverse_V[3]);
+	m_right = normalize(vec3(inverse_V[0]));
+	m_up = normalize(vec3(inverse_V[1]));
+	const vec3 forward = -normalize(vec3(inverse_V[2]));
+
+	const vec3 p00 = homogenize(inverse_PV * vec4(-1.0f, -1.0f, 1.0f, 1.0f));
+	const vec3 p10 = homogenize(inverse_PV * vec4(1.0f, -1.0f, 1.0f, 1.0f));
+	const vec3 p01 = homogenize(inverse_PV * vec4(-1.0f, 1.0f, 1.0f, 1.0f));
+	const float scale = 1.0f / dot(p00 - position, forward);
+	m_direction00 = (p00 - position) * scale;
+	m_dx = (p10 - p00) * (scale / float(width));
+	m_dy = (p01 - p00) * (scale / float(height));
+	m_lens_radius = lens_radius;
+	m_focal_distance = focal_distance;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The camera ray through pixel (x, y)
+///////////////////////////////////////////////////////////////////////////
+Ray Camera::generateRay(int x, int y, const CameraSample& sample) const
+{
+	const vec3 d = m_direction00 + (float(x) + sample.pixel.x) * m_dx + (float(y) + sample.pixel.y) * m_dy;
+	if(m_lens_radius <= 0.0f)
+	{
+		return Ray(position, normalize(d));
+	}
+	// Start somewhere on the lens and aim at the point that a pinhole
+	// camera would see at the focal distance.
+	float lens_x, lens_y;
+	concentricSampleDisk(sample.lens.x, sample.lens.y, &lens_x, &lens_y);
+	const vec3 origin = position + m_lens_radius * (lens_x * m_right + lens_y * m_up);
+	const vec3 focus = position + m_focal_distance * d;
+	return Ray(origin, normalize(focus - origin));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// N camera rays along a row of pixels, calculated as N-wide arrays
+///////////////////////////////////////////////////////////////////////////
+template<int N>
+void Camera::generateRays(int x, int y, const CameraSample* samples, Ray* rays) const
+{
+	float dx[N], dy[N], dz[N];
+	for(int i = 0; i < N; i++)
+	{
+		const float px = float(x + i) + samples[i].pixel.x;
+		const float py = float(y) + samples[i].pixel.y;
+		dx[i] = m_direction00.x + px * m_dx.x + py * m_dy.x;
+		dy[i] = m_direction00.y + px * m_dx.y + py * m_dy.y;
+		dz[i] = m_direction00.z + px * m_dx.z + py * m_dy.z;
+	}
+	float ox[N], oy[N], oz[N];
+	for(int i = 0; i < N; i++)
+	{
+		ox[i] = position.x;
+		oy[i] = position.y;
+		oz[i] = position.z;
+	}
+	if(m_lens_radius > 0.0f)
+	{
+		for(int i = 0; i < N; i++)
+		{
+			float lens_x, lens_y;
+			concentricSampleDisk(samples[i].lens.x, samples[i].lens.y, &lens_x, &lens_y);
+			lens_x *= m_lens_radius;
+			lens_y *= m_lens_radius;
+			const float offset_x = lens_x * m_right.x + lens_y * m_up.x;
+			const float offset_y = lens_x * m_right.y + lens_y * m_up.y;
+			const float offset_z = lens_x * m_right.z + lens_y * m_up.z;
+			ox[i] += offset_x;
+			oy[i] += offset_y;
+			oz[i] += offset_z;
+			dx[i] = m_focal_distance * dx[i] - offset_x;
+			dy[i] = m_focal_distance * dy[i] - offset_y;
+			dz[i] = m_focal_distance * dz[i] - offset_z;
+		}
+	}
+	for(int i = 0; i < N; i++)
+	{
+		const float inv_length = 1.0f / sqrtf(dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i]);
+		dx[i] *= inv_length;
+		dy[i] *= inv_length;
+		dz[i] *= inv_length;
+	}
+	for(int i = 0; i < N; i++)
+	{
+		rays[i] = Ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]));
+	}
+}
+
+template void Camera::generateRays<8>(int x, int y, const CameraSample* samples, Ray* rays) const;
+template void Camera::generateRays<16>(int x, int y, const CameraSample* samples, Ray* rays) const;
+} // namespace pathtracer
@@ -0,0 +1,52 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "embree.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Where inside the pixel (in [0,1)^2) and where on the lens (in [0,1)^2)
+// a camera ray should start.
+///////////////////////////////////////////////////////////////////////////
+struct CameraSample
+{
+	glm::vec2 pixel;
+	glm::vec2 lens;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Generates camera rays for one frame. Everything that only depends on
+// the view and projection matrices is calculated once in setup(), after
+// which a ray direction is just the direction of the first pixel plus a
+// per-pixel step in x and y. A lens radius larger than zero gives a thin
+// lens camera that is in focus at focal_distance.
+///////////////////////////////////////////////////////////////////////////
+class Camera
+{
+public:
+	void setup(const glm::mat4& V,
+	           const glm::mat4& P,
+	           int width,
+	           int height,
+	           float lens_radius = 0.0f,
+	           float focal_distance = 1.0f);
+	// The camera ray through pixel (x, y)
+	Ray generateRay(int x, int y, const CameraSample& sample) const;
+	// The camera rays through the N pixels (x, y) ... (x + N - 1, y). The
+	// rays are calculated N at a time, so the compiler can vectorize it.
+	// Instantiated for N = 8 and N = 16.
+	template<int N>
+	void generateRays(int x, int y, const CameraSample* samples, Ray* rays) const;
+
+	glm::vec3 position;
+
+private:
+	// Directions are kept unnormalized, scaled so that they are one unit
+	// long along the view direction.
+	glm::vec3 m_direction00; // Through the corner of pixel (0, 0)
+	glm::vec3 m_dx, m_dy;    // Change of direction per pixel
+	glm::vec3 m_right, m_up;
+	float m_lens_radius = 0.0f;
+	float m_focal_distance = 1.0f;
+};
+} // namespace pathtracer
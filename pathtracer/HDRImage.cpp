@@ -1,9 +1,13 @@
 #include "HDRImage.h"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 
 using namespace std;
 using namespace glm;
 
+static const float PI = 3.14159265359f;
+
 void HDRImage::load(const string& filename)
 {
 	stbi_set_flip_vertically_on_load(false);
@@ -14,6 +18,7 @@ void HDRImage::load(const string& filename)
 		std::cout << "Failed to load image: " << filename << ".\n";
 		exit(1);
 	}
+	buildDistribution();
 };
 
 vec3 HDRImage::sample(float u, float v)
@@ -21,4 +26,128 @@ vec3 HDRImage::sample(float u, float v)
 	int x = int(u * width) % width;
 	int y = int(v * height) % height;
 	return vec3(data[(y * width + x) * 3 + 0], data[(y * width + x) * 3 + 1], data[(y * width + x) * 3 + 2]);
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build an alias table for n weights (Vose's method)
+///////////////////////////////////////////////////////////////////////////
+void HDRImage::buildAliasTable(const float* weights, int n, AliasEntry* table)
+{
+	double sum = 0.0;
+	for(int i = 0; i < n; i++)
+	{
+		sum += weights[i];
+	}
+	vector<float> scaled(n);
+	vector<int> small, large;
+	for(int i = 0; i < n; i++)
+	{
+		// If everything is black, fall back to uniform
+		table[i].probability = sum > 0.0 ? float(weights[i] / sum) : 1.0f / float(n);
+		table[i].threshold = 1.0f;
+		table[i].alias = i;
+		scaled[i] = table[i].probability * float(n);
+		(scaled[i] < 1.0f ? small : large).push_back(i);
+	}
+	while(!small.empty() && !large.empty())
+	{
+		const int s = small.back(), l = large.back();
+		small.pop_back();
+		large.pop_back();
+		table[s].threshold = scaled[s];
+		table[s].alias = l;
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+		(scaled[l] < 1.0f ? small : large).push_back(l);
+	}
+	// Whatever is left is (up to rounding) exactly 1, and never aliased
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Pick an entry from an alias table. The part of u that was not used to
+// make the choice is returned in remapped_u, uniform in [0,1) again.
+///////////////////////////////////////////////////////////////////////////
+int HDRImage::sampleAliasTable(const AliasEntry* table, int n, float u, float& remapped_u)
+{
+	const float scaled = u * float(n);
+	const int i = std::min(int(scaled), n - 1);
+	const float f = std::min(scaled - float(i), 0.99999994f);
+	const AliasEntry& entry = table[i];
+	if(f < entry.threshold)
+	{
+		remapped_u = f / entry.threshold;
+		return i;
+	}
+	remapped_u = (f - entry.threshold) / (1.0f - entry.threshold);
+	return int(entry.alias);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Weight every texel with luminance * sin(theta), and build one alias
+// table over the rows and one over the texels of each row.
+///////////////////////////////////////////////////////////////////////////
+void HDRImage::buildDistribution()
+{
+	auto start_time = chrono::high_resolution_clock::now();
+	vector<float> weights(width * height);
+	vector<float> row_weights(height);
+	for(int y = 0; y < height; y++)
+	{
+		const float sin_theta = sin(PI * (float(y) + 0.5f) / float(height));
+		float row_sum = 0.0f;
+		for(int x = 0; x < width; x++)
+		{
+			const float* c = &data[(y * width + x) * 3];
+			const float luminance = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+			weights[y * width + x] = std::max(0.0f, luminance) * sin_theta;
+			row_sum += weights[y * width + x];
+		}
+		row_weights[y] = row_sum;
+	}
+	m_marginal.resize(height);
+	m_conditional.resize(width * height);
+	buildAliasTable(row_weights.data(), height, m_marginal.data());
+	for(int y = 0; y < height; y++)
+	{
+		buildAliasTable(&weights[y * width], width, &m_conditional[y * width]);
+	}
+	chrono::duration<float, milli> build_time = chrono::high_resolution_clock::now() - start_time;
+	distribution_build_time = build_time.count();
+	distribution_size = (m_marginal.size() + m_conditional.size()) * sizeof(AliasEntry);
+	cout << "Built environment map distribution (" << width << "x" << height << ") in "
+	     << distribution_build_time << " ms, " << distribution_size / 1024 << " KB.\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Pick a row, then a texel in that row, then a point in the texel
+///////////////////////////////////////////////////////////////////////////
+vec3 HDRImage::sample_direction(float u1, float u2, float& pdf) const
+{
+	float v_offset, u_offset;
+	const int y = sampleAliasTable(m_marginal.data(), height, u1, v_offset);
+	const int x = sampleAliasTable(&m_conditional[y * width], width, u2, u_offset);
+	const float theta = PI * (float(y) + v_offset) / float(height);
+	const float phi = 2.0f * PI * (float(x) + u_offset) / float(width);
+	const float sin_theta = sin(theta);
+	const float texel_probability = m_marginal[y].probability * m_conditional[y * width + x].probability;
+	// Texel probability -> density over [0,1]^2 -> density over the sphere
+	pdf = sin_theta > 0.0f ? texel_probability * float(width * height) / (2.0f * PI * PI * sin_theta) : 0.0f;
+	return vec3(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The density of sample_direction() for a direction
+///////////////////////////////////////////////////////////////////////////
+float HDRImage::pdf(const vec3& wi) const
+{
+	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
+	float phi = atan2(wi.z, wi.x);
+	if(phi < 0.0f)
+		phi = phi + 2.0f * PI;
+	const int x = std::min(int(phi / (2.0f * PI) * float(width)), width - 1);
+	const int y = std::min(int(theta / PI * float(height)), height - 1);
+	const float sin_theta = sin(theta);
+	if(sin_theta <= 0.0f)
+		return 0.0f;
+	const float texel_probability = m_marginal[y].probability * m_conditional[y * width + x].probability;
+	return texel_probability * float(width * height) / (2.0f * PI * PI * sin_theta);
+}
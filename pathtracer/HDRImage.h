@@ -1,10 +1,16 @@
 #pragma once
 #include <stb_image.h>
 #include <string>
+#include <vector>
+#include <cstdint>
 #include <glm/glm.hpp>
 
 ///////////////////////////////////////////////////////////////////////////
-// Simple helper class for loading HDR images with STB image
+// Simple helper class for loading HDR images with STB image. When loaded,
+// it also builds a distribution over the texels, proportional to their
+// luminance times the solid angle they cover (a lat-long map squeezes
+// rows together towards the poles), so that directions can be sampled
+// where most of the light comes from.
 ///////////////////////////////////////////////////////////////////////////
 struct HDRImage
 {
@@ -18,4 +24,32 @@ struct HDRImage
 	};
 	void load(const std::string& filename);
 	glm::vec3 sample(float u, float v);
-};
\ No newline at end of file
+	// Sample a direction from the distribution, given two uniform numbers
+	// in [0,1). Returns the direction and sets pdf (w.r.t. solid angle).
+	glm::vec3 sample_direction(float u1, float u2, float& pdf) const;
+	// The pdf (w.r.t. solid angle) of sample_direction() returning wi
+	float pdf(const glm::vec3& wi) const;
+
+	// Time to build the distribution (ms) and the memory it uses (bytes)
+	float distribution_build_time = 0.0f;
+	size_t distribution_size = 0;
+
+private:
+	///////////////////////////////////////////////////////////////////////
+	// An alias table: entry i is picked with probability "probability"
+	// (of the whole distribution), or else the table says to take entry
+	// "alias". Sampling is constant time.
+	///////////////////////////////////////////////////////////////////////
+	struct AliasEntry
+	{
+		float threshold;
+		uint32_t alias;
+		float probability;
+	};
+	void buildDistribution();
+	static void buildAliasTable(const float* weights, int n, AliasEntry* table);
+	static int sampleAliasTable(const AliasEntry* table, int n, float u, float& remapped_u);
+	// One entry per row, and one table of width entries for each row
+	std::vector<AliasEntry> m_marginal;
+	std::vector<AliasEntry> m_conditional;
+};
@@ -0,0 +1,79 @@
+#include "ImageFile.h"
+#include "tonemap.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+
+// The executables that use this file build Model.cpp without GL and do
+// not link labhelper (labhelper.cpp), so the stb implementations go here.
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+static bool endsWith(const string& text, const string& end)
+{
+	return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+}
+
+bool writeImage(const string& filename, const vector<vec3>& image, int width, int height)
+{
+	if(endsWith(filename, ".pfm"))
+	{
+		FILE* file = fopen(filename.c_str(), "wb");
+		if(file == nullptr)
+			return false;
+		// A negative scale says the floats are little endian
+		fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+		const size_t written = fwrite(&image[0].x, sizeof(vec3), image.size(), file);
+		fclose(file);
+		return written == image.size();
+	}
+	// The other formats go from the top down
+	vector<vec3> flipped(image.size());
+	for(int y = 0; y < height; y++)
+	{
+		copy(image.begin() + (height - 1 - y) * width, image.begin() + (height - y) * width,
+		     flipped.begin() + y * width);
+	}
+	if(endsWith(filename, ".hdr"))
+	{
+		return stbi_write_hdr(filename.c_str(), width, height, 3, &flipped[0].x) != 0;
+	}
+	if(endsWith(filename, ".png"))
+	{
+		vector<uint32_t> pixels(flipped.size());
+		tonemap(&flipped[0].x, int(flipped.size()), ToneMapping(), pixels.data());
+		return stbi_write_png(filename.c_str(), width, height, 4, pixels.data(), width * 4) != 0;
+	}
+	cout << "ERROR: " << filename << " is not .pfm, .hdr or .png\n";
+	return false;
+}
+
+bool readPFM(const string& filename, vector<vec3>& image, int& width, int& height)
+{
+	FILE* file = fopen(filename.c_str(), "rb");
+	if(file == nullptr)
+		return false;
+	char type[3] = "";
+	float scale = 0.0f;
+	// One whitespace character separates the header from the floats
+	const bool ok = fscanf(file, "%2s %d %d %f", type, &width, &height, &scale) == 4 && fgetc(file) != EOF
+	                && string(type) == "PF" && scale < 0.0f && width > 0 && height > 0;
+	if(!ok)
+	{
+		fclose(file);
+		return false;
+	}
+	image.resize(size_t(width) * height);
+	const size_t read = fread(&image[0].x, sizeof(vec3), image.size(), file);
+	fclose(file);
+	return read == image.size();
+}
+} // namespace pathtracer
@@ -0,0 +1,19 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////
+// Reading and writing rendered images, for the executables that run
+// without a window. The rows of an image go from the bottom up, like in
+// rendered_image and a GL texture.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+// Write the image as .pfm, .hdr (linear) or .png (clamped and sRGB encoded,
+// like the window shows it by default), depending on the extension of the
+// file name
+bool writeImage(const std::string& filename, const std::vector<glm::vec3>& image, int width, int height);
+// Read an RGB .pfm file written by writeImage()
+bool readPFM(const std::string& filename, std::vector<glm::vec3>& image, int& width, int& height);
+} // namespace pathtracer
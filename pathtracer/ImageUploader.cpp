@@ -0,0 +1,72 @@
+#include "ImageUploader.h"
+#include <GL/glew.h>
+#include <omp.h>
+
+namespace pathtracer
+{
+void ImageUploader::init()
+{
+	glGenTextures(1, &m_texture);
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glGenBuffers(2, m_pixel_buffers);
+}
+
+void ImageUploader::destroy()
+{
+	glDeleteBuffers(2, m_pixel_buffers);
+	glDeleteTextures(1, &m_texture);
+	m_pixel_buffers[0] = m_pixel_buffers[1] = 0;
+	m_buffer_sizes[0] = m_buffer_sizes[1] = 0;
+	m_texture = 0;
+	m_width = m_height = 0;
+}
+
+void ImageUploader::upload(const float* image, int width, int height, const ToneMapping& tonemapping)
+{
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	if(width != m_width || height != m_height)
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		m_width = width;
+		m_height = height;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Tonemap into the buffer that was not used last frame. Invalidating
+	// it lets the driver hand us fresh memory if the GL should still be
+	// reading from it.
+	///////////////////////////////////////////////////////////////////////
+	const size_t size = size_t(width) * size_t(height) * sizeof(uint32_t);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixel_buffers[m_next_buffer]);
+	if(m_buffer_sizes[m_next_buffer] != size)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		m_buffer_sizes[m_next_buffer] = size;
+	}
+	void* pixels =
+	    glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if(pixels != nullptr)
+	{
+		const double start = omp_get_wtime();
+		tonemap(image, width * height, tonemapping, static_cast<uint32_t*>(pixels));
+		m_tonemap_time = omp_get_wtime() - start;
+		///////////////////////////////////////////////////////////////////
+		// The buffer can be lost while mapped (e.g. on a mode switch), then
+		// we keep showing the last frame. With a buffer bound, the last
+		// argument of glTexSubImage2D is an offset into it.
+		///////////////////////////////////////////////////////////////////
+		if(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE)
+		{
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+	}
+	// Leave no buffer bound, or other texture uploads (ImGui) would read from it
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	m_next_buffer = 1 - m_next_buffer;
+}
+} // namespace pathtracer
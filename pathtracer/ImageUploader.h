@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "tonemap.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Gets the rendered image into a texture for the window. The image is
+// tonemapped straight into one of two pixel buffer objects and copied to
+// the texture from there with glTexSubImage2D. That copy happens in the
+// background, and the next frame writes the other buffer, so the main
+// thread never waits for it. Needs a GL context.
+///////////////////////////////////////////////////////////////////////////
+class ImageUploader
+{
+public:
+	// Create the texture and the pixel buffers
+	void init();
+	void destroy();
+	// Tonemap an RGB float image and start copying it to the texture. The
+	// texture is reallocated when the size changes.
+	void upload(const float* image, int width, int height, const ToneMapping& tonemapping);
+
+	uint32_t getTexture() const
+	{
+		return m_texture;
+	}
+	// Seconds spent tonemapping in the last upload()
+	double getTonemapTime() const
+	{
+		return m_tonemap_time;
+	}
+
+private:
+	uint32_t m_texture = 0;
+	uint32_t m_pixel_buffers[2] = { 0, 0 };
+	size_t m_buffer_sizes[2] = { 0, 0 };
+	int m_next_buffer = 0;
+	int m_width = 0, m_height = 0;
+	double m_tonemap_time = 0.0;
+};
+} // namespace pathtracer
@@ -0,0 +1,59 @@
+#include "PassGate.h"
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A thread first counts itself in and then looks for a pause, pause()
+// first sets the flag and then looks at the count. With sequentially
+// consistent atomics one of them sees the other.
+///////////////////////////////////////////////////////////////////////////
+void PassGate::enter()
+{
+	for(;;)
+	{
+		m_holders.fetch_add(1);
+		if(!m_paused.load())
+			return;
+		leave();
+		unique_lock<mutex> lock(m_lock);
+		m_changed.wait(lock, [this] { return !m_paused.load(); });
+	}
+}
+
+void PassGate::leave()
+{
+	if(m_holders.fetch_sub(1) == 1 && m_paused.load())
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_changed.notify_all();
+	}
+}
+
+double PassGate::pause()
+{
+	const double start = omp_get_wtime();
+	unique_lock<mutex> lock(m_lock);
+	m_paused.store(true);
+	m_changed.wait(lock, [this] { return m_holders.load() == 0; });
+	return omp_get_wtime() - start;
+}
+
+void PassGate::resume()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_paused.store(false);
+	}
+	m_changed.notify_all();
+}
+
+void PassGate::cancel()
+{
+	m_cancelled.store(true);
+	m_cancel_count++;
+	m_cancel_time = omp_get_wtime();
+}
+} // namespace pathtracer
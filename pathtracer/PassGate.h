@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <omp.h>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Lets one other thread (the UI) stop the rendering threads in the middle
+// of a pass, change the scene or the settings, and let them go on. A
+// rendering thread holds the gate while it reads the scene, the settings
+// or rendered_image, and offers to stop at checkpoints between tiles
+// (wavefront stages). If restart() cancelled the pass in the meantime,
+// the checkpoint tells the thread to drop the rest of it. Holding the
+// gate costs two atomic operations, a checkpoint one load, as long as
+// nobody pauses.
+///////////////////////////////////////////////////////////////////////////
+class PassGate
+{
+public:
+	// For rendering threads. A thread must not enter twice.
+	void enter();
+	void leave();
+	// Wait here while paused. Returns false if the pass was cancelled.
+	bool checkpoint()
+	{
+		if(m_paused.load(std::memory_order_relaxed))
+		{
+			leave();
+			enter();
+		}
+		return !m_cancelled.load();
+	}
+	bool cancelled() const
+	{
+		return m_cancelled.load();
+	}
+	// A new pass starts, forget about cancelled ones
+	void beginPass()
+	{
+		m_cancelled.store(false);
+	}
+
+	// Wait until no thread holds the gate, and keep them out until
+	// resume(). Returns how long the wait took, in seconds.
+	double pause();
+	void resume();
+	// Drop the rest of the pass in flight
+	void cancel();
+	// How many times cancel() was called, and when it was last called
+	// (omp_get_wtime()). Read while holding the gate.
+	int getCancelCount() const
+	{
+		return m_cancel_count;
+	}
+	double getCancelTime() const
+	{
+		return m_cancel_time;
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+	std::atomic<int> m_holders{ 0 };
+	std::atomic<bool> m_paused{ false };
+	std::atomic<bool> m_cancelled{ false };
+	int m_cancel_count = 0;
+	double m_cancel_time = 0.0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Holds the gate for one thread of a parallel region. The thread that
+// starts the region must leave the gate before it and enter it again
+// after it, and this must go out of scope before any barrier (use nowait
+// loops). Otherwise a thread waiting at the barrier while holding the
+// gate would wait for a parked one, and a pause for it.
+///////////////////////////////////////////////////////////////////////////
+class TeamGate
+{
+public:
+	explicit TeamGate(PassGate& gate) : m_gate(gate)
+	{
+		m_gate.enter();
+	}
+	~TeamGate()
+	{
+		m_gate.leave();
+	}
+
+private:
+	PassGate& m_gate;
+};
+} // namespace pathtracer
@@ -6,6 +6,9 @@
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "wavefront.h"
+#include "Camera.h"
+#include "statistics.h"
 
 using namespace std;
 using namespace glm;
@@ -19,14 +22,22 @@ Settings settings;
 Environment environment;
 Image rendered_image;
 PointLight point_light;
+TileScheduler tile_scheduler;
+PassGate pass_gate;
+PrimaryHitCache primary_hit_cache;
 
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
 ///////////////////////////////////////////////////////////////////////////
 void restart()
 {
-	// No need to clear image,
+	// No need to clear image, the first sample of a pixel overwrites it
 	rendered_image.number_of_samples = 0;
+	std::fill(rendered_image.sample_count.begin(), rendered_image.sample_count.end(), 0);
+	rendered_image.converged_fraction = 0.0f;
+	rendered_image.progressive_stride = 0;
+	resetStatistics();
+	pass_gate.cancel();
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -35,9 +46,7 @@ void restart()
 ///////////////////////////////////////////////////////////////////////////
 void resize(int w, int h)
 {
-	rendered_image.width = w / settings.subsampling;
-	rendered_image.height = h / settings.subsampling;
-	rendered_image.data.resize(rendered_image.width * rendered_image.height);
+	rendered_image.resize(w / settings.subsampling, h / settings.subsampling);
 	restart();
 }
 
@@ -55,6 +64,135 @@ vec3 Lenvironment(const vec3& wi)
 	return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Offset a ray origin away from the surface, to the side wi points to
+///////////////////////////////////////////////////////////////////////////
+vec3 offsetRayOrigin(const Intersection& hit, const vec3& wi)
+{
+	const vec3 n = dot(wi, hit.geometry_normal) > 0.0f ? hit.geometry_normal : -hit.geometry_normal;
+	return hit.position + EPSILON * n;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Power heuristic (beta = 2) for combining two sampling strategies
+///////////////////////////////////////////////////////////////////////////
+static float powerHeuristic(float pdf_a, float pdf_b)
+{
+	const float a2 = pdf_a * pdf_a, b2 = pdf_b * pdf_b;
+	return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Next-event estimation. The point light can only be reached this way, so
+// it needs no weighting. The environment can also be hit by following the
+// brdf, so its sample is weighted with the power heuristic against that.
+///////////////////////////////////////////////////////////////////////////
+int sampleLightDirections(const Intersection& hit, LightDirection directions[2])
+{
+	int num_directions = 0;
+	const vec3& n = hit.shading_normal;
+	{
+		const vec3 to_light = point_light.position - hit.position;
+		const float distance_to_light = length(to_light);
+		const vec3 wi = to_light / distance_to_light;
+		const float cosine = dot(wi, n);
+		if(cosine > 0.0f)
+		{
+			const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+			vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+			LightDirection& d = directions[num_directions++];
+			d.wi = wi;
+			d.shadow_ray = Ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light);
+			d.radiance = Li * cosine;
+			d.mis_pdf = 0.0f;
+		}
+	}
+	{
+		// Always draw both numbers, so that the dimensions stay the same
+		const float u1 = randf(), u2 = randf();
+		float light_pdf;
+		const vec3 wi = environment.map.sample_direction(u1, u2, light_pdf);
+		const float cosine = dot(wi, n);
+		if(environment.multiplier > 0.0f && light_pdf > 0.0f && cosine > 0.0f)
+		{
+			LightDirection& d = directions[num_directions++];
+			d.wi = wi;
+			d.shadow_ray = Ray(offsetRayOrigin(hit, wi), wi);
+			d.radiance = Lenvironment(wi) * cosine / light_pdf;
+			d.mis_pdf = light_pdf;
+		}
+	}
+	return num_directions;
+}
+
+vec3 lightContribution(const LightDirection& direction, const vec3& brdf, float brdf_pdf)
+{
+	const float weight = direction.mis_pdf > 0.0f ? powerHeuristic(direction.mis_pdf, brdf_pdf) : 1.0f;
+	return brdf * direction.radiance * weight;
+}
+
+int sampleLights(const Intersection& hit, const MaterialRecord& mat, LightSample samples[2])
+{
+	LightDirection directions[2];
+	const int num_samples = sampleLightDirections(hit, directions);
+	for(int i = 0; i < num_samples; i++)
+	{
+		const LightDirection& d = directions[i];
+		const vec3& n = hit.shading_normal;
+		const float brdf_pdf = d.mis_pdf > 0.0f ? materialPdf(mat, d.wi, hit.wo, n) : 0.0f;
+		samples[i].shadow_ray = d.shadow_ray;
+		samples[i].contribution = lightContribution(d, materialF(mat, d.wi, hit.wo, n), brdf_pdf);
+		count(COUNTER_BRDF_EVALUATIONS);
+	}
+	return num_samples;
+}
+
+float environmentMisWeight(float brdf_pdf, const vec3& wi)
+{
+	if(brdf_pdf <= 0.0f)
+		return 1.0f;
+	return powerHeuristic(brdf_pdf, environment.map.pdf(wi));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// First-hit features for the denoiser
+///////////////////////////////////////////////////////////////////////////
+PixelFeatures pixelFeatures(const Ray& primary_ray)
+{
+	PixelFeatures features;
+	if(primary_ray.geomID == RTC_INVALID_GEOMETRY_ID)
+	{
+		features.albedo = vec3(1.0f);
+		features.normal = vec3(0.0f);
+		features.depth = 0.0f;
+		return features;
+	}
+	const Intersection hit = getIntersection(primary_ray);
+	features.albedo = material_table[hit.material_index].color;
+	features.normal = hit.shading_normal;
+	features.depth = primary_ray.tfar * length(primary_ray.d);
+	return features;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Russian roulette, after the first few bounces the path survives with a
+// probability given by its largest throughput component.
+///////////////////////////////////////////////////////////////////////////
+static const int RUSSIAN_ROULETTE_BOUNCE = 3;
+
+bool russianRoulette(int bounce, vec3& throughput)
+{
+	// Always draw the number, so that the dimensions stay the same
+	const float u = randf();
+	if(bounce < RUSSIAN_ROULETTE_BOUNCE)
+		return true;
+	const float survive = std::min(1.0f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+	if(u >= survive)
+		return false;
+	throughput /= survive;
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Calculate the radiance going from one point (r.hitPosition()) in one
 // direction (-r.d), through path tracing.
@@ -64,38 +202,314 @@ vec3 Li(Ray& primary_ray)
 	vec3 L = vec3(0.0f);
 	vec3 path_throughput = vec3(1.0);
 	Ray current_ray = primary_ray;
+	float brdf_pdf = 0.0f;
+	int path_length = 0;
 
-	///////////////////////////////////////////////////////////////////
-	// Get the intersection information from the ray
-	///////////////////////////////////////////////////////////////////
-	Intersection hit = getIntersection(current_ray);
-	///////////////////////////////////////////////////////////////////
-	// Create a Material tree for evaluating brdfs and calculating
-	// sample directions.
-	///////////////////////////////////////////////////////////////////
-
-	Diffuse diffuse(hit.material->m_color);
-	BRDF& mat = diffuse;
-	///////////////////////////////////////////////////////////////////
-	// Calculate Direct Illumination from light.
-	///////////////////////////////////////////////////////////////////
-	{
-		const float distance_to_light = length(point_light.position - hit.position);
-		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-		vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-		vec3 wi = normalize(point_light.position - hit.position);
-		L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+	for(int bounce = 0; bounce <= settings.max_bounces; bounce++)
+	{
+		setRandomDimension(RANDOM_PATH + bounce * RANDOM_DIMENSIONS_PER_BOUNCE);
+		///////////////////////////////////////////////////////////////////
+		// The primary ray has been intersected already. If a later ray
+		// escapes, add the (MIS weighted) environment and stop.
+		///////////////////////////////////////////////////////////////////
+		if(bounce > 0)
+		{
+			count(COUNTER_SECONDARY_RAYS);
+			if(!intersect(current_ray))
+			{
+				count(COUNTER_ESCAPED_RAYS);
+				L += path_throughput * Lenvironment(current_ray.d) * environmentMisWeight(brdf_pdf, current_ray.d);
+				break;
+			}
+		}
+		path_length++;
+		///////////////////////////////////////////////////////////////////
+		// Get the intersection information from the ray
+		///////////////////////////////////////////////////////////////////
+		Intersection hit = getIntersection(current_ray);
+		///////////////////////////////////////////////////////////////////
+		// Look up the compiled material for evaluating brdfs and
+		// calculating sample directions.
+		///////////////////////////////////////////////////////////////////
+		const MaterialRecord& mat = material_table[hit.material_index];
+		///////////////////////////////////////////////////////////////////
+		// Add emitted radiance from intersection
+		///////////////////////////////////////////////////////////////////
+		L += path_throughput * mat.emission * mat.color;
+		///////////////////////////////////////////////////////////////////
+		// Calculate Direct Illumination from the light and environment
+		///////////////////////////////////////////////////////////////////
+		LightSample light_samples[2];
+		const int num_light_samples = sampleLights(hit, mat, light_samples);
+		count(COUNTER_SHADOW_RAYS, num_light_samples);
+		for(int i = 0; i < num_light_samples; i++)
+		{
+			if(!occluded(light_samples[i].shadow_ray))
+			{
+				L += path_throughput * light_samples[i].contribution;
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// Sample an incoming direction from the brdf and continue the path
+		///////////////////////////////////////////////////////////////////
+		vec3 wi;
+		vec3 brdf = materialSampleWi(mat, wi, hit.wo, hit.shading_normal, brdf_pdf);
+		count(COUNTER_BRDF_EVALUATIONS);
+		if(brdf_pdf <= 0.0f)
+			break;
+		path_throughput *= brdf * std::abs(dot(wi, hit.shading_normal)) / brdf_pdf;
+		if(path_throughput == vec3(0.0f))
+			break;
+		///////////////////////////////////////////////////////////////////
+		// At the last vertex the path ends here, but the environment sample
+		// above was weighted against this brdf sample, so the brdf sample
+		// still has to bring its share of the environment light.
+		///////////////////////////////////////////////////////////////////
+		if(bounce == settings.max_bounces)
+		{
+			if(environment.multiplier > 0.0f)
+			{
+				count(COUNTER_SHADOW_RAYS);
+				Ray escape_ray(offsetRayOrigin(hit, wi), wi);
+				if(!occluded(escape_ray))
+				{
+					L += path_throughput * Lenvironment(wi) * environmentMisWeight(brdf_pdf, wi);
+				}
+			}
+			break;
+		}
+		if(!russianRoulette(bounce, path_throughput))
+			break;
+		current_ray = Ray(offsetRayOrigin(hit, wi), wi);
 	}
+	countPathLength(path_length);
 	// Return the final outgoing radiance for the primary ray
 	return L;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to homogenize points transformed with projection matrices
+// Pick where in the pixel and where on the lens the next camera ray
+// starts. Without antialiasing, all rays go through the pixel center.
+///////////////////////////////////////////////////////////////////////////
+CameraSample cameraSample()
+{
+	// Always draw all four numbers, so that the dimensions stay the same
+	const float u[4] = { randf(), randf(), randf(), randf() };
+	CameraSample sample;
+	sample.pixel = settings.antialiasing ? vec2(u[0], u[1]) : vec2(0.5f);
+	sample.lens = vec2(u[2], u[3]);
+	return sample;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Radiance along a primary ray that has already been intersected
+///////////////////////////////////////////////////////////////////////////
+static vec3 shadePrimaryRay(Ray& primaryRay)
+{
+	if(primaryRay.geomID != RTC_INVALID_GEOMETRY_ID)
+	{
+		// If it hit something, evaluate the radiance from that point
+		return Li(primaryRay);
+	}
+	// Otherwise evaluate environment
+	count(COUNTER_ESCAPED_RAYS);
+	countPathLength(0);
+	return Lenvironment(primaryRay.d);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Adaptive sampling: after ADAPTIVE_MIN_SAMPLES samples, a pixel is
+// converged when its relative error is below settings.adaptive_threshold.
+// Each pass spends as many samples as there are pixels, spread over the
+// pixels that have not converged (at most ADAPTIVE_MAX_SAMPLES each).
 ///////////////////////////////////////////////////////////////////////////
-inline static glm::vec3 homogenize(const glm::vec4& p)
+static const int ADAPTIVE_MIN_SAMPLES = 16;
+static const int ADAPTIVE_MAX_SAMPLES = 16;
+
+///////////////////////////////////////////////////////////////////////////
+// Progressive refinement: after a restart, the first pass samples every
+// PROGRESSIVE_COARSEST_STRIDE-th pixel in x and y, and each pass after it
+// a grid twice as fine, until all pixels are sampled. The samples of the
+// coarse grids count as samples of their pixels. A level is skipped when
+// the finer one is expected to take at most settings.target_pass_time,
+// going by what a sample cost in the last pass.
+///////////////////////////////////////////////////////////////////////////
+static const int PROGRESSIVE_COARSEST_STRIDE = 4;
+static double seconds_per_sample = 0.0;
+// How many samples the pass in flight takes, over all pixels
+static int pass_sample_total = 0;
+
+static int progressiveStride()
 {
-	return glm::vec3(p * (1.f / p.w));
+	const int width = rendered_image.width, height = rendered_image.height;
+	const int previous = rendered_image.progressive_stride;
+	int stride = previous == 0 ? PROGRESSIVE_COARSEST_STRIDE : previous / 2;
+	while(stride > 1 && seconds_per_sample > 0.0)
+	{
+		const int finer = stride / 2;
+		const double num_samples = double((width + finer - 1) / finer) * double((height + finer - 1) / finer);
+		if(1000.0 * seconds_per_sample * num_samples > settings.target_pass_time)
+			break;
+		stride = finer;
+	}
+	return stride;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Decide how many samples each pixel gets in this pass, and return the
+// largest such number.
+///////////////////////////////////////////////////////////////////////////
+static int distributeSamples()
+{
+	const int width = rendered_image.width;
+	const int num_pixels = rendered_image.width * rendered_image.height;
+	if(settings.progressive && rendered_image.progressive_stride != 1)
+	{
+		const int stride = progressiveStride();
+		rendered_image.progressive_stride = stride;
+		if(stride > 1)
+		{
+#pragma omp parallel for
+			for(int i = 0; i < num_pixels; i++)
+			{
+				const bool on_grid = (i % width) % stride == 0 && (i / width) % stride == 0;
+				rendered_image.pass_samples[i] = on_grid ? 1 : 0;
+			}
+			pass_sample_total = ((width + stride - 1) / stride) * ((rendered_image.height + stride - 1) / stride);
+			rendered_image.converged_fraction = 0.0f;
+			return 1;
+		}
+	}
+	if(!settings.adaptive_sampling || rendered_image.number_of_samples < ADAPTIVE_MIN_SAMPLES)
+	{
+		std::fill(rendered_image.pass_samples.begin(), rendered_image.pass_samples.end(), 1);
+		pass_sample_total = num_pixels;
+		rendered_image.converged_fraction = 0.0f;
+		return 1;
+	}
+	int num_active = 0;
+#pragma omp parallel for reduction(+ : num_active)
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const bool active = rendered_image.relativeError(i) > settings.adaptive_threshold;
+		rendered_image.pass_samples[i] = active ? 1 : 0;
+		num_active += active ? 1 : 0;
+	}
+	rendered_image.converged_fraction = 1.0f - float(num_active) / float(std::max(1, num_pixels));
+	if(num_active == 0)
+		return 0;
+	const int samples_per_pixel = std::max(1, std::min(ADAPTIVE_MAX_SAMPLES, num_pixels / num_active));
+	pass_sample_total = num_active * samples_per_pixel;
+#pragma omp parallel for
+	for(int i = 0; i < num_pixels; i++)
+	{
+		rendered_image.pass_samples[i] *= uint8_t(samples_per_pixel);
+	}
+	return samples_per_pixel;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// After a pass that was not cancelled: remember what a sample cost, and
+// count the pass as a sample of every pixel unless it only sampled a
+// coarse progressive level
+///////////////////////////////////////////////////////////////////////////
+static void finishPass(double pass_time)
+{
+	endPass(pass_time);
+	primary_hit_cache.endPass(statistics.last_pass.counters[COUNTER_CACHED_HITS], omp_get_max_threads());
+	seconds_per_sample = pass_time / double(std::max(1, pass_sample_total));
+	if(rendered_image.progressive_stride <= 1)
+		rendered_image.number_of_samples += 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Debug view of how many samples each pixel got so far
+///////////////////////////////////////////////////////////////////////////
+void sampleHeatmap(std::vector<glm::vec3>& heatmap)
+{
+	const int num_pixels = rendered_image.width * rendered_image.height;
+	heatmap.resize(num_pixels);
+	int max_count = 1;
+	for(int i = 0; i < num_pixels; i++)
+	{
+		max_count = std::max(max_count, rendered_image.sample_count[i]);
+	}
+#pragma omp parallel for
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const float t = float(rendered_image.sample_count[i]) / float(max_count);
+		heatmap[i] = mix(vec3(0.0f, 0.0f, 1.0f), vec3(1.0f, 0.0f, 0.0f), t) * (0.25f + 0.75f * t);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The image, with pixels that have no samples yet filled in from the
+// coarser progressive levels
+///////////////////////////////////////////////////////////////////////////
+void upscaledImage(std::vector<glm::vec3>& image)
+{
+	image = rendered_image.data;
+	if(rendered_image.progressive_stride <= 1)
+		return;
+	const int width = rendered_image.width, num_pixels = rendered_image.width * rendered_image.height;
+#pragma omp parallel for
+	for(int i = 0; i < num_pixels; i++)
+	{
+		if(rendered_image.sample_count[i] > 0)
+			continue;
+		const int x = i % width, y = i / width;
+		for(int stride = 2; stride <= PROGRESSIVE_COARSEST_STRIDE; stride *= 2)
+		{
+			const int coarse = (y - y % stride) * width + (x - x % stride);
+			if(rendered_image.sample_count[coarse] > 0)
+			{
+				image[i] = rendered_image.data[coarse];
+				break;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Find the hits of a batch of camera rays (ray i belongs to the current
+// sample of pixels[i]). Hits from the primary hit cache are copied, the
+// other rays are traced together and added to the cache.
+///////////////////////////////////////////////////////////////////////////
+static void traceCameraRays(RayBatch& rays, const vector<int>& pixels, RayBatch& uncached, vector<int>& indices)
+{
+	indices.clear();
+	for(size_t i = 0; i < rays.size(); i++)
+	{
+		if(!primary_hit_cache.lookup(pixels[i], rendered_image.sample_count[pixels[i]], rays[i]))
+			indices.push_back(int(i));
+	}
+	count(COUNTER_CACHED_HITS, rays.size() - indices.size());
+	if(indices.empty())
+		return;
+	const double start = omp_get_wtime();
+	if(indices.size() == rays.size())
+	{
+		intersect(rays);
+	}
+	else
+	{
+		uncached.clear();
+		for(int i : indices)
+		{
+			uncached.add(rays[i]);
+		}
+		intersect(uncached);
+		for(size_t j = 0; j < indices.size(); j++)
+		{
+			rays[indices[j]] = uncached[j];
+		}
+	}
+	primary_hit_cache.addTraceTime(omp_get_wtime() - start, indices.size());
+	count(COUNTER_PRIMARY_RAYS, indices.size());
+	for(int i : indices)
+	{
+		primary_hit_cache.store(pixels[i], rendered_image.sample_count[pixels[i]], rays[i]);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -103,52 +517,236 @@ inline static glm::vec3 homogenize(const glm::vec4& p)
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const glm::mat4& V, const glm::mat4& P)
 {
+	pass_gate.enter();
+	pass_gate.beginPass();
 	// Stop here if we have as many samples as we want
 	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
 	   && (settings.max_paths_per_pixel != 0))
 	{
+		pass_gate.leave();
 		return;
 	}
-	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	// Trace one path per pixel (the omp parallel stuf magically distributes the
-	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
+	const double pass_start = omp_get_wtime();
+	///////////////////////////////////////////////////////////////////////
+	// Everything needed to generate camera rays is set up once per pass
+	///////////////////////////////////////////////////////////////////////
+	Camera camera;
+	camera.setup(V, P, rendered_image.width, rendered_image.height, settings.lens_radius,
+	             settings.focal_distance);
+	primary_hit_cache.beginPass(V, P, rendered_image.width, rendered_image.height,
+	                            settings.primary_cache_samples);
 
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
+	///////////////////////////////////////////////////////////////////////
+	// Decide which pixels get samples in this pass
+	///////////////////////////////////////////////////////////////////////
+	setSampler(settings.sampler);
+	const int pass_samples = distributeSamples();
+	if(pass_samples == 0)
 	{
-		for(int x = 0; x < rendered_image.width; x++)
+		pass_gate.leave();
+		return;
+	}
+
+	if(settings.integrator == INTEGRATOR_WAVEFRONT)
+	{
+		if(tracePathsWavefront(camera))
 		{
-			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-			                        float(y) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
-			{
-				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
-			}
-			else
+			finishPass(omp_get_wtime() - pass_start);
+		}
+		else
+		{
+			discardPass();
+		}
+		pass_gate.leave();
+		return;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Split the image into tiles and let each thread grab tiles until
+	// there are none left. Threads that run out of work steal tiles from
+	// the others. Each thread holds the gate while it works on a tile,
+	// so a pause or a restart only waits for the tiles in flight.
+	///////////////////////////////////////////////////////////////////////
+	tile_scheduler.setup(rendered_image.width, rendered_image.height, settings.tile_size,
+	                     settings.tile_order, omp_get_max_threads());
+	tile_scheduler.beginPass();
+
+	pass_gate.leave();
+#pragma omp parallel
+	{
+		const int thread = omp_get_thread_num();
+		TeamGate team_gate(pass_gate);
+		Tile tile;
+		RayBatch primary_rays, uncached_rays;
+		primary_rays.coherent = true;
+		uncached_rays.coherent = true;
+		vector<int> ray_pixels, uncached_indices;
+		CameraSample samples[8];
+		while(pass_gate.checkpoint() && tile_scheduler.nextTile(thread, tile))
+		{
+			const double tile_start = omp_get_wtime();
+			for(int s = 0; s < pass_samples; s++)
 			{
-				// Otherwise evaluate environment
-				color = Lenvironment(primaryRay.d);
+				if(settings.use_ray_packets)
+				{
+					///////////////////////////////////////////////////////
+					// Generate and trace the primary rays of all pixels in
+					// the tile that want this sample as packets, then
+					// shade the hits one by one. Full rows of eight pixels
+					// are generated eight at a time.
+					///////////////////////////////////////////////////////
+					primary_rays.clear();
+					ray_pixels.clear();
+					for(int y = tile.y0; y < tile.y1; y++)
+					{
+						const int row = y * rendered_image.width;
+						for(int x = tile.x0; x < tile.x1;)
+						{
+							bool full_span = x + 8 <= tile.x1;
+							for(int i = 0; full_span && i < 8; i++)
+							{
+								full_span = rendered_image.pass_samples[row + x + i] > s;
+							}
+							if(full_span)
+							{
+								for(int i = 0; i < 8; i++)
+								{
+									const int pixel = row + x + i;
+									seedRandom(pixel, rendered_image.sample_count[pixel], RANDOM_CAMERA);
+									samples[i] = cameraSample();
+									ray_pixels.push_back(pixel);
+								}
+								primary_rays.rays.resize(primary_rays.size() + 8);
+								camera.generateRays<8>(x, y, samples, &primary_rays[primary_rays.size() - 8]);
+								x += 8;
+								continue;
+							}
+							if(rendered_image.pass_samples[row + x] > s)
+							{
+								const int pixel = row + x;
+								seedRandom(pixel, rendered_image.sample_count[pixel], RANDOM_CAMERA);
+								primary_rays.add(camera.generateRay(x, y, cameraSample()));
+								ray_pixels.push_back(pixel);
+							}
+							x++;
+						}
+					}
+					traceCameraRays(primary_rays, ray_pixels, uncached_rays, uncached_indices);
+					for(size_t i = 0; i < primary_rays.size(); i++)
+					{
+						const int pixel = ray_pixels[i];
+						seedRandom(pixel, rendered_image.sample_count[pixel], RANDOM_PATH);
+						vec3 color = shadePrimaryRay(primary_rays[i]);
+						rendered_image.accumulate(ray_pixels[i], color);
+						if(gatherFeatures())
+							rendered_image.accumulateFeatures(pixel, pixelFeatures(primary_rays[i]));
+					}
+				}
+				else
+				{
+					for(int y = tile.y0; y < tile.y1; y++)
+					{
+						for(int x = tile.x0; x < tile.x1; x++)
+						{
+							const int pixel = y * rendered_image.width + x;
+							if(rendered_image.pass_samples[pixel] <= s)
+								continue;
+							seedRandom(pixel, rendered_image.sample_count[pixel], RANDOM_CAMERA);
+							Ray ray = camera.generateRay(x, y, cameraSample());
+							if(primary_hit_cache.lookup(pixel, rendered_image.sample_count[pixel], ray))
+							{
+								count(COUNTER_CACHED_HITS);
+							}
+							else
+							{
+								const double trace_start = omp_get_wtime();
+								intersect(ray);
+								primary_hit_cache.addTraceTime(omp_get_wtime() - trace_start, 1);
+								primary_hit_cache.store(pixel, rendered_image.sample_count[pixel], ray);
+								count(COUNTER_PRIMARY_RAYS);
+							}
+							seedRandom(pixel, rendered_image.sample_count[pixel], RANDOM_PATH);
+							vec3 color = shadePrimaryRay(ray);
+							rendered_image.accumulate(pixel, color);
+							if(gatherFeatures())
+								rendered_image.accumulateFeatures(pixel, pixelFeatures(ray));
+						}
+					}
+				}
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
+			tile_scheduler.addBusyTime(thread, omp_get_wtime() - tile_start);
 		}
 	}
-	rendered_image.number_of_samples += 1;
+	pass_gate.enter();
+	if(pass_gate.cancelled())
+	{
+		discardPass();
+		pass_gate.leave();
+		return;
+	}
+	tile_scheduler.endPass(omp_get_wtime() - pass_start);
+	finishPass(omp_get_wtime() - pass_start);
+	pass_gate.leave();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Measure how fast the BVH traces coherent and incoherent rays
+///////////////////////////////////////////////////////////////////////////
+RayThroughput measureRayThroughput(const glm::mat4& V, const glm::mat4& P)
+{
+	const int width = rendered_image.width, height = rendered_image.height;
+	const int num_pixels = width * height;
+	const int chunk = 256;
+	const int num_chunks = (num_pixels + chunk - 1) / chunk;
+	Camera camera;
+	camera.setup(V, P, width, height);
+	vector<Ray> rays(num_pixels);
+	CameraSample center;
+	center.pixel = vec2(0.5f);
+	center.lens = vec2(0.5f);
+#pragma omp parallel for
+	for(int i = 0; i < num_pixels; i++)
+	{
+		rays[i] = camera.generateRay(i % width, i / width, center);
+	}
+	RayThroughput result;
+	double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic)
+	for(int c = 0; c < num_chunks; c++)
+	{
+		const int first = c * chunk;
+		intersect(&rays[first], std::min(chunk, num_pixels - first), true);
+	}
+	result.primary = num_pixels / (1e6 * (omp_get_wtime() - start));
+
+	///////////////////////////////////////////////////////////////////////
+	// Bounce every hit in a cosine distributed direction
+	///////////////////////////////////////////////////////////////////////
+	vector<Ray> bounces;
+	bounces.reserve(num_pixels);
+	for(int i = 0; i < num_pixels; i++)
+	{
+		if(rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+			continue;
+		seedRandom(i, 0, RANDOM_PATH);
+		Intersection hit = getIntersection(rays[i]);
+		const vec3 n = dot(hit.geometry_normal, hit.wo) > 0.0f ? hit.geometry_normal : -hit.geometry_normal;
+		vec3 tangent = normalize(perpendicular(n));
+		vec3 bitangent = normalize(cross(tangent, n));
+		vec3 d = cosineSampleHemisphere();
+		vec3 wi = normalize(d.x * tangent + d.y * bitangent + d.z * n);
+		bounces.push_back(Ray(offsetRayOrigin(hit, wi), wi));
+	}
+	const int num_bounces = int(bounces.size());
+	const int num_bounce_chunks = (num_bounces + chunk - 1) / chunk;
+	start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic)
+	for(int c = 0; c < num_bounce_chunks; c++)
+	{
+		const int first = c * chunk;
+		intersect(&bounces[first], std::min(chunk, num_bounces - first), false);
+	}
+	result.secondary = num_bounces > 0 ? num_bounces / (1e6 * (omp_get_wtime() - start)) : 0.0;
+	return result;
 }
 }; // namespace pathtracer
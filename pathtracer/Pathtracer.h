@@ -1,9 +1,16 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <vector>
+#include <cfloat>
+#include <cstdint>
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "TileScheduler.h"
+#include "PassGate.h"
+#include "PrimaryHitCache.h"
+#include "sampling.h"
+#include "embree.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -16,6 +23,17 @@ using namespace glm;
 
 namespace pathtracer
 {
+///////////////////////////////////////////////////////////////////////////////
+// The available integrators. The path integrator traces one path at a
+// time, depth first. The wavefront integrator advances all paths of the
+// image one bounce at a time.
+///////////////////////////////////////////////////////////////////////////////
+enum Integrator
+{
+	INTEGRATOR_PATH = 0,
+	INTEGRATOR_WAVEFRONT
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Path Tracer settings
 ///////////////////////////////////////////////////////////////////////////////
@@ -24,8 +42,56 @@ extern struct Settings
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	int tile_size;
+	TileOrder tile_order;
+	bool use_ray_packets;
+	Integrator integrator;
+	bool antialiasing;
+	float lens_radius;
+	float focal_distance;
+	bool adaptive_sampling;
+	float adaptive_threshold;
+	SamplerType sampler;
+	bool dynamic_geometry;
+	float rebuild_threshold;
+	BVHBackend bvh_backend;          // Takes effect when the scene is rebuilt
+	unsigned embree_scene_flags;     // RTC_SCENE_COMPACT, _COHERENT, _HIGH_QUALITY, _ROBUST
+	unsigned embree_algorithm_flags; // RTC_INTERSECT8, RTC_INTERSECT_STREAM (RTC_INTERSECT1 is implied)
+	int embree_threads;              // For building BVHs (either backend), 0 = one per hardware thread
+	bool denoise;
+	int denoise_iterations;
+	bool reprojection;         // Reproject the image when the camera moves, see reproject()
+	int max_history;           // The most samples a reprojected pixel keeps
+	bool progressive;          // Sample coarse grids of pixels first after a restart
+	float target_pass_time;    // Milliseconds, picks the first progressive level
+	int primary_cache_samples; // Samples per pixel whose camera ray hits are cached, 0 = off
 } settings;
 
+// The first-hit features are needed by the denoiser and by reprojection
+inline bool gatherFeatures()
+{
+	return settings.denoise || settings.reprojection;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hands out image tiles to the rendering threads. Also keeps track of how
+// busy each thread was during the last pass.
+///////////////////////////////////////////////////////////////////////////////
+extern TileScheduler tile_scheduler;
+
+///////////////////////////////////////////////////////////////////////////////
+// Lets another thread pause tracePaths() between tiles, see PassGate.
+// restart() cancels the pass in flight.
+///////////////////////////////////////////////////////////////////////////////
+extern PassGate pass_gate;
+
+///////////////////////////////////////////////////////////////////////////////
+// The camera ray hits of the first settings.primary_cache_samples samples
+// of each pixel, reused by the passes after a restart that kept the camera
+// and the geometry.
+///////////////////////////////////////////////////////////////////////////////
+extern PrimaryHitCache primary_hit_cache;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
 ///////////////////////////////////////////////////////////////////////////////
@@ -36,16 +102,90 @@ extern struct Environment
 } environment;
 
 ///////////////////////////////////////////////////////////////////////////
-// The rendered image
+// What the camera ray of a sample hit first, for the denoiser: the albedo
+// of the material, the shading normal and the distance along the ray. A
+// ray that escapes has albedo one, and no normal or depth.
+///////////////////////////////////////////////////////////////////////////
+struct PixelFeatures
+{
+	glm::vec3 albedo;
+	glm::vec3 normal;
+	float depth;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The rendered image. Besides the running average of each pixel, we keep
+// the number of samples taken and the running variance of the luminance
+// (Welford's algorithm) per pixel, so that adaptive sampling can tell
+// which pixels have converged. While gatherFeatures(), the average
+// first-hit features are kept as well.
 ///////////////////////////////////////////////////////////////////////////
 extern struct Image
 {
 	int width, height, number_of_samples = 0;
 	std::vector<glm::vec3> data;
+	std::vector<int> sample_count;
+	std::vector<float> luminance_m2;
+	std::vector<glm::vec3> albedo;
+	std::vector<glm::vec3> normal;
+	std::vector<float> depth;
+	// How many samples each pixel gets in the current pass
+	std::vector<uint8_t> pass_samples;
+	float converged_fraction = 0.0f;
+	// With settings.progressive, the spacing of the pixels the last pass
+	// sampled (4, 2, or 1 for all of them). 0 before the first pass.
+	int progressive_stride = 0;
 	float* getPtr()
 	{
 		return &data[0].x;
 	}
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		data.resize(width * height);
+		sample_count.resize(width * height);
+		luminance_m2.resize(width * height);
+		pass_samples.resize(width * height);
+		albedo.resize(width * height);
+		normal.resize(width * height);
+		depth.resize(width * height);
+	}
+	static float luminance(const glm::vec3& c)
+	{
+		return dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+	// Add one more sample to the running average of a pixel
+	void accumulate(int index, const glm::vec3& color)
+	{
+		const int n = ++sample_count[index];
+		if(n == 1)
+		{
+			data[index] = color;
+			luminance_m2[index] = 0.0f;
+			return;
+		}
+		const float delta = luminance(color) - luminance(data[index]);
+		data[index] += (color - data[index]) * (1.0f / float(n));
+		luminance_m2[index] += delta * (luminance(color) - luminance(data[index]));
+	}
+	// Add the features of the sample that accumulate() just added
+	void accumulateFeatures(int index, const PixelFeatures& features)
+	{
+		const float w = 1.0f / float(sample_count[index]);
+		albedo[index] += (features.albedo - albedo[index]) * w;
+		normal[index] += (features.normal - normal[index]) * w;
+		depth[index] += (features.depth - depth[index]) * w;
+	}
+	// Estimated standard error of a pixel's mean, relative to the mean
+	float relativeError(int index) const
+	{
+		const int n = sample_count[index];
+		if(n < 2)
+			return FLT_MAX;
+		const float variance = luminance_m2[index] / float(n - 1);
+		return sqrt(variance / float(n)) / (luminance(data[index]) + 0.001f);
+	}
 } rendered_image;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -70,7 +210,86 @@ void restart();
 void resize(int w, int h);
 
 ///////////////////////////////////////////////////////////////////////////
-// Trace one path per pixel
+// Debug view of how many samples each pixel got so far, from blue (few)
+// to red (many).
+///////////////////////////////////////////////////////////////////////////
+void sampleHeatmap(std::vector<glm::vec3>& heatmap);
+
+///////////////////////////////////////////////////////////////////////////
+// The image for display. While the progressive levels are coarse, pixels
+// without samples show the nearest pixel of a coarser level that has
+// some, so each level is shown upscaled until the next one is done.
+///////////////////////////////////////////////////////////////////////////
+void upscaledImage(std::vector<glm::vec3>& image);
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel. Holds pass_gate while it runs, so the caller
+// must not.
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one camera ray per pixel as packets, then one diffuse bounce from
+// every hit as a stream, and return how many million rays per second the
+// current BVH managed for each.
+///////////////////////////////////////////////////////////////////////////
+struct RayThroughput
+{
+	double primary;
+	double secondary;
+};
+RayThroughput measureRayThroughput(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Helpers shared by the integrators
+///////////////////////////////////////////////////////////////////////////
+// Which dimensions of a sample (see seedRandom()) are used for what. The
+// camera uses four (position in pixel and on lens), and each bounce of
+// the path gets RANDOM_DIMENSIONS_PER_BOUNCE, starting at RANDOM_PATH.
+enum RandomDimension
+{
+	RANDOM_CAMERA = 0,
+	RANDOM_PATH = 4,
+	RANDOM_DIMENSIONS_PER_BOUNCE = 8
+};
+struct CameraSample;
+struct MaterialRecord;
+// Radiance from the environment map in direction wi
+vec3 Lenvironment(const vec3& wi);
+// Random position in the pixel and on the lens for the next camera ray
+CameraSample cameraSample();
+// Where a ray leaving the surface in direction wi should start
+vec3 offsetRayOrigin(const Intersection& hit, const vec3& wi);
+// A shadow ray, and the radiance it brings if it is not occluded
+struct LightSample
+{
+	Ray shadow_ray;
+	vec3 contribution;
+};
+// Next-event estimation: one sample of the point light and one of the
+// environment map (weighted against brdf sampling). Writes at most two
+// samples and returns how many. Uses two random dimensions.
+int sampleLights(const Intersection& hit, const MaterialRecord& mat, LightSample samples[2]);
+// The same in two steps, so that the brdf can be evaluated elsewhere. A
+// light direction holds the light arriving along it times the cosine, over
+// the pdf it was picked with. mis_pdf is that pdf if following the brdf
+// can also find the light, 0 if not (no weighting).
+struct LightDirection
+{
+	Ray shadow_ray;
+	vec3 wi;
+	vec3 radiance;
+	float mis_pdf;
+};
+int sampleLightDirections(const Intersection& hit, LightDirection directions[2]);
+// What a light direction brings, given the brdf and its pdf for it
+vec3 lightContribution(const LightDirection& direction, const vec3& brdf, float brdf_pdf);
+// MIS weight of the environment when a brdf sampled ray (with pdf
+// brdf_pdf, or 0 for camera rays) escapes the scene in direction wi.
+float environmentMisWeight(float brdf_pdf, const vec3& wi);
+// The first-hit features of a camera ray that has been intersected
+PixelFeatures pixelFeatures(const Ray& primary_ray);
+// Randomly end paths with low throughput, and boost the ones that survive.
+// Returns false if the path ends. Uses one random dimension.
+bool russianRoulette(int bounce, vec3& throughput);
 }; // namespace pathtracer
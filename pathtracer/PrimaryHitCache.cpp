@@ -0,0 +1,57 @@
+#include "PrimaryHitCache.h"
+#include <algorithm>
+#include "Pathtracer.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+void PrimaryHitCache::beginPass(const mat4& V, const mat4& P, int width, int height, int num_samples)
+{
+	const bool same = V == m_view && P == m_projection && width == m_width && height == m_height
+	                  && num_samples == m_num_samples && settings.antialiasing == m_antialiasing
+	                  && settings.lens_radius == m_lens_radius && settings.focal_distance == m_focal_distance
+	                  && int(settings.sampler) == m_sampler && getSceneVersion() == m_scene_version;
+	if(same)
+		return;
+	m_view = V;
+	m_projection = P;
+	m_width = width;
+	m_height = height;
+	m_num_samples = num_samples;
+	m_antialiasing = settings.antialiasing;
+	m_lens_radius = settings.lens_radius;
+	m_focal_distance = settings.focal_distance;
+	m_sampler = int(settings.sampler);
+	m_scene_version = getSceneVersion();
+	const size_t size = size_t(width) * size_t(height) * size_t(num_samples);
+	if(size == 0)
+	{
+		vector<Hit>().swap(m_hits);
+		vector<uint8_t>().swap(m_valid);
+		return;
+	}
+	m_hits.resize(size);
+	m_valid.assign(size, 0);
+}
+
+void PrimaryHitCache::addTraceTime(double seconds, size_t num_rays)
+{
+	m_trace_nanoseconds.fetch_add(int64_t(seconds * 1e9), memory_order_relaxed);
+	m_traced_rays.fetch_add(int64_t(num_rays), memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The cost of a camera ray is taken from the last pass that traced some,
+// so a pass that found all of its hits in the cache uses the one before.
+///////////////////////////////////////////////////////////////////////////
+void PrimaryHitCache::endPass(uint64_t num_cached, int num_threads)
+{
+	const int64_t traced = m_traced_rays.exchange(0);
+	const int64_t nanoseconds = m_trace_nanoseconds.exchange(0);
+	if(traced > 0)
+		m_seconds_per_ray = 1e-9 * double(nanoseconds) / double(traced);
+	m_saved_time = double(num_cached) * m_seconds_per_ray / double(std::max(1, num_threads));
+}
+} // namespace pathtracer
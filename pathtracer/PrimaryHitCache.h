@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "embree.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Remembers where the camera rays of the first few samples of each pixel
+// hit the scene (the hit fields of the Ray: distance, geometric normal,
+// barycentrics and the ids of the triangle), so that passes after a
+// restart that only changed the shading (materials, lights, bounces) do
+// not trace them again. The camera ray of a sample only depends on the
+// pixel and the sample index, so the hits stay valid until the camera,
+// the image size, the camera ray settings or the geometry change.
+//
+// lookup() and store() may be called from any thread, as long as no two
+// threads work on the same sample at the same time.
+///////////////////////////////////////////////////////////////////////////
+class PrimaryHitCache
+{
+public:
+	// Keep the hits if nothing they depend on changed since the last
+	// pass, drop them otherwise. Keeps num_samples samples per pixel, 0
+	// turns the cache off.
+	void beginPass(const glm::mat4& V, const glm::mat4& P, int width, int height, int num_samples);
+	// If the hit of this sample's camera ray is known, copy it into the
+	// (freshly generated) ray and return true
+	bool lookup(int pixel, int sample, Ray& ray) const
+	{
+		if(sample >= m_num_samples || !m_valid[size_t(pixel) * m_num_samples + sample])
+			return false;
+		const Hit& hit = m_hits[size_t(pixel) * m_num_samples + sample];
+		ray.tfar = hit.tfar;
+		ray.n = hit.n;
+		ray.u = hit.u;
+		ray.v = hit.v;
+		ray.geomID = hit.geom_id;
+		ray.primID = hit.prim_id;
+		ray.instID = hit.inst_id;
+		return true;
+	}
+	// Keep the hit of a camera ray that was just traced
+	void store(int pixel, int sample, const Ray& ray)
+	{
+		if(sample >= m_num_samples)
+			return;
+		Hit& hit = m_hits[size_t(pixel) * m_num_samples + sample];
+		hit.tfar = ray.tfar;
+		hit.n = ray.n;
+		hit.u = ray.u;
+		hit.v = ray.v;
+		hit.geom_id = ray.geomID;
+		hit.prim_id = ray.primID;
+		hit.inst_id = ray.instID;
+		m_valid[size_t(pixel) * m_num_samples + sample] = 1;
+	}
+	// Time a thread spent tracing camera rays that were not cached
+	void addTraceTime(double seconds, size_t num_rays);
+	// Estimate how much time the num_cached hits used in the pass saved,
+	// from what the traced camera rays cost
+	void endPass(uint64_t num_cached, int num_threads);
+
+	// Seconds saved in the last pass
+	double getSavedTime() const
+	{
+		return m_saved_time;
+	}
+	size_t getMemory() const
+	{
+		return m_hits.capacity() * sizeof(Hit) + m_valid.capacity();
+	}
+
+private:
+	struct Hit
+	{
+		float tfar, u, v;
+		uint32_t geom_id, prim_id, inst_id;
+		glm::vec3 n;
+	};
+	std::vector<Hit> m_hits; // m_num_samples per pixel
+	std::vector<uint8_t> m_valid;
+	int m_num_samples = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// What the hits depend on
+	///////////////////////////////////////////////////////////////////////
+	glm::mat4 m_view = glm::mat4(0.0f), m_projection = glm::mat4(0.0f);
+	int m_width = 0, m_height = 0;
+	bool m_antialiasing = false;
+	float m_lens_radius = 0.0f, m_focal_distance = 0.0f;
+	int m_sampler = -1;
+	uint32_t m_scene_version = 0;
+
+	std::atomic<int64_t> m_trace_nanoseconds{ 0 };
+	std::atomic<int64_t> m_traced_rays{ 0 };
+	double m_seconds_per_ray = 0.0; // Of one thread
+	double m_saved_time = 0.0;
+};
+} // namespace pathtracer
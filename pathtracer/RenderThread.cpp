@@ -0,0 +1,162 @@
+#include "RenderThread.h"
+#include "Pathtracer.h"
+#include "denoiser.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+void RenderThread::start()
+{
+	m_stop.store(false);
+	m_thread = thread(&RenderThread::run, this);
+}
+
+void RenderThread::stop()
+{
+	if(!m_thread.joinable())
+		return;
+	pause();
+	pass_gate.cancel();
+	m_stop.store(true);
+	resume();
+	m_thread.join();
+}
+
+double RenderThread::pause()
+{
+	return pass_gate.pause();
+}
+
+void RenderThread::resume()
+{
+	pass_gate.resume();
+	{
+		lock_guard<mutex> lock(m_wake_lock);
+		m_woken = true;
+	}
+	m_wake.notify_one();
+}
+
+void RenderThread::setCamera(const mat4& V, const mat4& P)
+{
+	m_view = V;
+	m_projection = P;
+}
+
+void RenderThread::setShowHeatmap(bool show)
+{
+	if(show != m_show_heatmap)
+	{
+		m_show_heatmap = show;
+		m_refresh_count++;
+	}
+}
+
+void RenderThread::refresh()
+{
+	m_refresh_count++;
+}
+
+const Frame& RenderThread::latestFrame(bool& fresh)
+{
+	fresh = (m_newest.load() & NEW_FRAME) != 0;
+	if(fresh)
+		m_front = m_newest.exchange(m_front) & ~NEW_FRAME;
+	return m_frames[m_front];
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Render passes until stopped. When there is nothing left to do (enough
+// samples, or all pixels converged), sleep until the UI changes something.
+///////////////////////////////////////////////////////////////////////////
+void RenderThread::run()
+{
+	int published_passes = -1, published_cancels = -1, published_refreshes = -1;
+	double restart_latency = 0.0;
+	while(!m_stop.load())
+	{
+		{
+			lock_guard<mutex> lock(m_wake_lock);
+			m_woken = false;
+		}
+		pass_gate.enter();
+		const mat4 V = m_view, P = m_projection;
+		const int cancels = pass_gate.getCancelCount();
+		pass_gate.leave();
+
+		tracePaths(V, P);
+
+		pass_gate.enter();
+		if(pass_gate.getCancelCount() != cancels && statistics.passes > 0)
+		{
+			// A restart() (or reproject()) between reading the camera and
+			// the start of the pass let a pass with the old camera through
+			restart();
+		}
+		// Passes since the last restart, including coarse progressive ones
+		const bool changed = statistics.passes != published_passes
+		                     || pass_gate.getCancelCount() != published_cancels
+		                     || m_refresh_count != published_refreshes;
+		if(changed && statistics.passes > 0)
+		{
+			if(pass_gate.getCancelCount() != published_cancels)
+				restart_latency = omp_get_wtime() - pass_gate.getCancelTime();
+			m_frames[m_back].restart_latency = restart_latency;
+			publish();
+			published_passes = statistics.passes;
+			published_cancels = pass_gate.getCancelCount();
+			published_refreshes = m_refresh_count;
+		}
+		pass_gate.leave();
+
+		if(!changed)
+		{
+			unique_lock<mutex> lock(m_wake_lock);
+			m_wake.wait(lock, [this] { return m_woken || m_stop.load(); });
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fill in the back frame and make it the newest. Called while holding
+// pass_gate.
+///////////////////////////////////////////////////////////////////////////
+void RenderThread::publish()
+{
+	Frame& frame = m_frames[m_back];
+	frame.width = rendered_image.width;
+	frame.height = rendered_image.height;
+	frame.number_of_samples = rendered_image.number_of_samples;
+	frame.converged_fraction = rendered_image.converged_fraction;
+	frame.progressive_stride = rendered_image.progressive_stride;
+	frame.denoise_time = 0.0;
+	frame.heatmap = m_show_heatmap;
+	if(m_show_heatmap)
+	{
+		sampleHeatmap(frame.image);
+	}
+	else if(settings.denoise && rendered_image.progressive_stride <= 1)
+	{
+		const double start = omp_get_wtime();
+		denoise(frame.image);
+		frame.denoise_time = omp_get_wtime() - start;
+	}
+	else
+	{
+		upscaledImage(frame.image);
+	}
+	frame.pass_time = tile_scheduler.getPassTime();
+	frame.num_tiles = tile_scheduler.getNumTiles();
+	frame.thread_stats.resize(tile_scheduler.getNumThreads());
+	for(int t = 0; t < tile_scheduler.getNumThreads(); t++)
+	{
+		frame.thread_stats[t] = tile_scheduler.getThreadStats(t);
+	}
+	frame.statistics = statistics;
+	frame.cache_memory = primary_hit_cache.getMemory();
+	frame.cache_saved_time = primary_hit_cache.getSavedTime();
+	m_back = m_newest.exchange(m_back | NEW_FRAME) & ~NEW_FRAME;
+}
+} // namespace pathtracer
@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glm/glm.hpp>
+#include "TileScheduler.h"
+#include "statistics.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A finished pass, ready to be shown, with what the UI wants to know
+// about it. Everything is copied, so the UI can read it while the next
+// pass is rendered.
+///////////////////////////////////////////////////////////////////////////
+struct Frame
+{
+	std::vector<glm::vec3> image; // The image, denoised or the sample heatmap
+	bool heatmap = false;
+	int width = 0, height = 0;
+	int number_of_samples = 0;
+	float converged_fraction = 0.0f;
+	int progressive_stride = 0; // See Image::progressive_stride
+	double denoise_time = 0.0;
+	// The primary hit cache: bytes used, and seconds it saved in the last pass
+	size_t cache_memory = 0;
+	double cache_saved_time = 0.0;
+	// From restart() to the first frame after it, in seconds
+	double restart_latency = 0.0;
+	// The last pass, as the tile scheduler and the counters saw it
+	double pass_time = 0.0;
+	int num_tiles = 0;
+	std::vector<ThreadStats> thread_stats;
+	Statistics statistics;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Renders passes on a thread of its own (which runs the OpenMP team of
+// each pass), so that the UI never waits for a pass to finish. After
+// each pass, the image is copied into the back one of three frames, and
+// the back frame is swapped with the newest one with a single atomic
+// exchange. The UI swaps the newest frame with the one it shows in the
+// same way, so neither side ever waits for the other.
+//
+// Between pause() and resume() the UI may change the scene, the settings
+// and call restart(). The render thread stops at the next tile (or
+// wavefront stage) for that, and drops the rest of the pass if it was
+// restarted.
+///////////////////////////////////////////////////////////////////////////
+class RenderThread
+{
+public:
+	void start();
+	void stop();
+	bool isRunning() const
+	{
+		return m_thread.joinable();
+	}
+	// Returns how long it took for the render thread to stop, in seconds
+	double pause();
+	void resume();
+	// Call while paused
+	void setCamera(const glm::mat4& V, const glm::mat4& P);
+	void setShowHeatmap(bool show);
+	// Publish the image again, after a display setting changed
+	void refresh();
+
+	// The newest frame. Stays valid and unchanged until the next call.
+	// fresh tells whether it was returned before.
+	const Frame& latestFrame(bool& fresh);
+
+private:
+	void run();
+	void publish();
+
+	std::thread m_thread;
+	std::atomic<bool> m_stop{ false };
+	// Woken after each resume(), in case it was idle
+	std::mutex m_wake_lock;
+	std::condition_variable m_wake;
+	bool m_woken = false;
+
+	// Written by the UI while paused, read by the render thread while
+	// it holds pass_gate
+	glm::mat4 m_view = glm::mat4(1.0f), m_projection = glm::mat4(1.0f);
+	bool m_show_heatmap = false;
+	int m_refresh_count = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// Triple buffer. m_newest holds the index of the newest frame, plus
+	// NEW_FRAME if the UI has not seen it yet.
+	///////////////////////////////////////////////////////////////////////
+	static const int NEW_FRAME = 4;
+	Frame m_frames[3];
+	int m_back = 0;
+	std::atomic<int> m_newest{ 1 };
+	int m_front = 2;
+};
+} // namespace pathtracer
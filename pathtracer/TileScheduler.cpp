@@ -0,0 +1,219 @@
+#include "TileScheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <new>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Interleave the bits of x and y to get the position along a Z-curve
+///////////////////////////////////////////////////////////////////////////
+static uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v) {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Split the image into tiles and order them
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::setup(int width, int height, int tile_size, TileOrder order, int num_threads)
+{
+	tile_size = std::max(1, tile_size);
+	num_threads = std::max(1, num_threads);
+	if(width == m_width && height == m_height && tile_size == m_tile_size && order == m_order
+	   && num_threads == m_num_threads)
+	{
+		return;
+	}
+	m_width = width;
+	m_height = height;
+	m_tile_size = tile_size;
+	m_order = order;
+	m_num_threads = num_threads;
+
+	///////////////////////////////////////////////////////////////////////
+	// Create the tiles in scanline order
+	///////////////////////////////////////////////////////////////////////
+	const int tiles_x = (width + tile_size - 1) / tile_size;
+	const int tiles_y = (height + tile_size - 1) / tile_size;
+	m_tiles.clear();
+	vector<uint64_t> keys;
+	for(int ty = 0; ty < tiles_y; ty++)
+	{
+		for(int tx = 0; tx < tiles_x; tx++)
+		{
+			Tile tile;
+			tile.x0 = tx * tile_size;
+			tile.y0 = ty * tile_size;
+			tile.x1 = std::min(width, tile.x0 + tile_size);
+			tile.y1 = std::min(height, tile.y0 + tile_size);
+			m_tiles.push_back(tile);
+
+			///////////////////////////////////////////////////////////////
+			// Sort key for the requested order. Morton order keeps tiles
+			// that are handed out after each other close in the image,
+			// spiral order starts in the middle (where the interesting
+			// stuff usually is) and works its way outwards ring by ring.
+			///////////////////////////////////////////////////////////////
+			uint64_t key = uint64_t(ty) * tiles_x + tx;
+			if(order == TILE_ORDER_MORTON)
+			{
+				key = mortonCode(tx, ty);
+			}
+			else if(order == TILE_ORDER_SPIRAL)
+			{
+				const int dx = tx - tiles_x / 2;
+				const int dy = ty - tiles_y / 2;
+				const uint64_t ring = std::max(abs(dx), abs(dy));
+				const float angle = atan2(float(dy), float(dx)) + 3.14159265f;
+				key = (ring << 32) | uint64_t(angle * 100000.0f);
+			}
+			keys.push_back(key);
+		}
+	}
+	vector<int> permutation(m_tiles.size());
+	for(size_t i = 0; i < permutation.size(); i++)
+	{
+		permutation[i] = int(i);
+	}
+	stable_sort(permutation.begin(), permutation.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+	vector<Tile> sorted_tiles(m_tiles.size());
+	for(size_t i = 0; i < permutation.size(); i++)
+	{
+		sorted_tiles[i] = m_tiles[permutation[i]];
+	}
+	m_tiles.swap(sorted_tiles);
+
+	///////////////////////////////////////////////////////////////////////
+	// Give each thread a contiguous range of the ordered tiles, so that
+	// the tiles a thread renders are close to each other.
+	///////////////////////////////////////////////////////////////////////
+	allocateQueues(num_threads);
+	const int num_tiles = int(m_tiles.size());
+	for(int t = 0; t < num_threads; t++)
+	{
+		m_queues[t].first = int((int64_t(num_tiles) * t) / num_threads);
+		m_queues[t].last = int((int64_t(num_tiles) * (t + 1)) / num_threads);
+		m_queues[t].head = m_queues[t].tail = m_queues[t].first;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// new only aligns to 16 bytes before C++17, so the queues are constructed
+// in a buffer that is aligned to a cache line by hand
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::allocateQueues(int num_threads)
+{
+	freeQueues();
+	size_t space = num_threads * sizeof(WorkQueue) + alignof(WorkQueue);
+	m_queue_memory.reset(new char[space]);
+	void* memory = m_queue_memory.get();
+	memory = std::align(alignof(WorkQueue), num_threads * sizeof(WorkQueue), memory, space);
+	m_queues = static_cast<WorkQueue*>(memory);
+	for(int t = 0; t < num_threads; t++)
+	{
+		new(&m_queues[t]) WorkQueue();
+	}
+	m_num_queues = num_threads;
+}
+
+void TileScheduler::freeQueues()
+{
+	if(m_queues == nullptr)
+		return;
+	for(int t = 0; t < m_num_queues; t++)
+	{
+		m_queues[t].~WorkQueue();
+	}
+	m_queues = nullptr;
+	m_num_queues = 0;
+	m_queue_memory.reset();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Deal out all tiles to the thread queues and reset the statistics
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::beginPass()
+{
+	for(int t = 0; t < m_num_threads; t++)
+	{
+		m_queues[t].head = m_queues[t].first;
+		m_queues[t].tail = m_queues[t].last;
+		m_queues[t].stats = ThreadStats();
+	}
+}
+
+bool TileScheduler::popFront(int thread, int& tile_index)
+{
+	WorkQueue& q = m_queues[thread];
+	lock_guard<mutex> guard(q.lock);
+	if(q.head == q.tail)
+		return false;
+	tile_index = q.head++;
+	return true;
+}
+
+bool TileScheduler::stealBack(int victim, int& tile_index)
+{
+	WorkQueue& q = m_queues[victim];
+	lock_guard<mutex> guard(q.lock);
+	if(q.head == q.tail)
+		return false;
+	tile_index = --q.tail;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the next tile for a thread, stealing if the own queue is empty
+///////////////////////////////////////////////////////////////////////////
+bool TileScheduler::nextTile(int thread, Tile& tile)
+{
+	// If OpenMP gave us more threads than we planned for, they only steal
+	const bool owns_queue = thread < m_num_threads;
+	int tile_index;
+	bool found = owns_queue && popFront(thread, tile_index);
+	bool stolen = false;
+	for(int i = 1; !found && i <= m_num_threads; i++)
+	{
+		found = stolen = stealBack((thread + i) % m_num_threads, tile_index);
+	}
+	if(!found)
+		return false;
+	tile = m_tiles[tile_index];
+	if(owns_queue)
+	{
+		m_queues[thread].stats.tiles_rendered++;
+		m_queues[thread].stats.tiles_stolen += stolen ? 1 : 0;
+	}
+	return true;
+}
+
+void TileScheduler::addBusyTime(int thread, double seconds)
+{
+	if(thread < m_num_threads)
+		m_queues[thread].stats.busy_time += seconds;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Whatever part of the pass a thread was not rendering, it was idle
+///////////////////////////////////////////////////////////////////////////
+void TileScheduler::endPass(double pass_time)
+{
+	m_pass_time = pass_time;
+	for(int t = 0; t < m_num_threads; t++)
+	{
+		m_queues[t].stats.idle_time = std::max(0.0, pass_time - m_queues[t].stats.busy_time);
+	}
+}
+} // namespace pathtracer
@@ -0,0 +1,108 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A rectangular block of pixels, [x0, x1) x [y0, y1)
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The order in which tiles are dealt out to the threads
+///////////////////////////////////////////////////////////////////////////
+enum TileOrder
+{
+	TILE_ORDER_SCANLINE = 0,
+	TILE_ORDER_MORTON,
+	TILE_ORDER_SPIRAL,
+	TILE_ORDER_COUNT
+};
+
+///////////////////////////////////////////////////////////////////////////
+// What one thread did during the last pass (times in seconds)
+///////////////////////////////////////////////////////////////////////////
+struct ThreadStats
+{
+	double busy_time = 0.0;
+	double idle_time = 0.0;
+	int tiles_rendered = 0;
+	int tiles_stolen = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Splits the image into tiles and hands them out to the threads. Every
+// thread owns a queue of tiles that it works through front to back. A
+// thread whose queue is empty steals from the back of the other queues,
+// so that threads that got cheap (sky) tiles help out with the expensive
+// ones instead of idling at the end of the pass.
+///////////////////////////////////////////////////////////////////////////
+class TileScheduler
+{
+public:
+	~TileScheduler()
+	{
+		freeQueues();
+	}
+	// Split the image into tiles and order them. Only does work if any of
+	// the parameters changed since the last call.
+	void setup(int width, int height, int tile_size, TileOrder order, int num_threads);
+	// Deal out all tiles to the thread queues and reset the statistics
+	void beginPass();
+	// Get the next tile for a thread. Returns false when there is no work
+	// left anywhere.
+	bool nextTile(int thread, Tile& tile);
+	// Add time spent rendering a tile to a thread
+	void addBusyTime(int thread, double seconds);
+	// Calculate idle times from the wall-clock time of the whole pass
+	void endPass(double pass_time);
+
+	int getNumThreads() const
+	{
+		return m_num_threads;
+	}
+	int getNumTiles() const
+	{
+		return int(m_tiles.size());
+	}
+	double getPassTime() const
+	{
+		return m_pass_time;
+	}
+	const ThreadStats& getThreadStats(int thread) const
+	{
+		return m_queues[thread].stats;
+	}
+
+private:
+	///////////////////////////////////////////////////////////////////////
+	// One queue per thread. The owner pops from the front (head), thieves
+	// take from the back (tail). Each queue gets cache lines of its own
+	// so that threads do not fight over each others queues.
+	///////////////////////////////////////////////////////////////////////
+	struct alignas(64) WorkQueue
+	{
+		std::mutex lock;
+		int first, last; // Range of m_tiles dealt to this queue
+		int head, tail;  // What is left of it
+		ThreadStats stats;
+	};
+	void allocateQueues(int num_threads);
+	void freeQueues();
+	bool popFront(int thread, int& tile_index);
+	bool stealBack(int victim, int& tile_index);
+
+	int m_width = 0, m_height = 0, m_tile_size = 0, m_num_threads = 0;
+	TileOrder m_order = TILE_ORDER_SCANLINE;
+	double m_pass_time = 0.0;
+	std::vector<Tile> m_tiles;
+	std::unique_ptr<char[]> m_queue_memory;
+	WorkQueue* m_queues = nullptr; // Constructed in m_queue_memory
+	int m_num_queues = 0;
+};
+} // namespace pathtracer
@@ -0,0 +1,702 @@
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks of the parts of the pathtracer, on the scenes in scenes/ and
+// with fixed seeds, so that runs can be compared:
+//
+//	- Ray throughput (Mrays/s) of intersect() and occluded() for primary,
+//	  shadow and incoherent secondary rays, with every available backend
+//	- getIntersection(), the brdfs of each kind of material (both the
+//	  BRDF classes and the flat materials), HDRImage and the sampling
+//	  functions, in ns per operation
+//	- How long rendering takes to get within a given RMSE of a high spp
+//	  reference image, which is rendered and stored the first time
+//
+// Everything but the convergence test runs once per thread count. The
+// ns/op are wall-clock time per operation with all threads working.
+// See printUsage() for the options.
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "Camera.h"
+#include "embree.h"
+#include "material.h"
+#include "sampling.h"
+#include "ImageFile.h"
+
+using namespace glm;
+using namespace std;
+using namespace pathtracer;
+
+///////////////////////////////////////////////////////////////////////////////
+// The scenes to benchmark on
+///////////////////////////////////////////////////////////////////////////////
+struct SceneModel
+{
+	const char* filename;
+	vec3 translation;
+};
+
+struct BenchmarkScene
+{
+	const char* name;
+	vector<SceneModel> models;
+	vec3 camera_position;
+	vec3 camera_target;
+};
+
+static const BenchmarkScene scenes[] = {
+	{ "ship",
+	  { { "../scenes/NewShip.obj", vec3(0.0f, 10.0f, 0.0f) }, { "../scenes/landingpad2.obj", vec3(0.0f) } },
+	  vec3(-30.0f, 10.0f, 30.0f),
+	  vec3(0.0f, 10.0f, 0.0f) },
+	{ "city", { { "../scenes/city.obj", vec3(0.0f) } }, vec3(-60.0f, 40.0f, 60.0f), vec3(0.0f, 5.0f, 0.0f) },
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Command line options
+///////////////////////////////////////////////////////////////////////////////
+struct Options
+{
+	const BenchmarkScene* scene = &scenes[0];
+	string envmap = "../scenes/envmaps/001_dl_0.hdr";
+	int width = 640, height = 360;
+	vector<int> threads;
+	bool convergence = true;
+	int convergence_width = 320, convergence_height = 180;
+	int reference_spp = 1024;
+	string reference;
+	vector<float> rmse_targets = { 0.1f, 0.05f, 0.03f };
+	double max_convergence_time = 60.0;
+};
+
+static void printUsage()
+{
+	cerr << "Usage: pathtracer-benchmark [options]\n"
+	        "  --scene NAME           ship or city\n"
+	        "  --envmap FILE          Environment map (.hdr)\n"
+	        "  --size WxH             Resolution of the ray and shading benchmarks\n"
+	        "  --threads N,N,...      Thread counts (default: 1, 2, 4, ... up to all)\n"
+	        "  --no-convergence       Skip the convergence test\n"
+	        "  --convergence-size WxH Resolution of the convergence test\n"
+	        "  --reference FILE       Reference image (.pfm), rendered if missing or of the\n"
+	        "                         wrong size (default: benchmark-SCENE-WxH.pfm).\n"
+	        "                         Delete it after changing the renderer.\n"
+	        "  --reference-spp N      Samples per pixel of a new reference image\n"
+	        "  --rmse R,R,...         RMSE to measure the time to\n"
+	        "  --time SECONDS         Longest the convergence test may render\n";
+}
+
+template<typename T>
+static bool parseList(const char* text, vector<T>& list)
+{
+	list.clear();
+	istringstream stream(text);
+	string item;
+	while(getline(stream, item, ','))
+	{
+		istringstream item_stream(item);
+		T value;
+		if(!(item_stream >> value))
+			return false;
+		list.push_back(value);
+	}
+	return !list.empty();
+}
+
+static bool parseArguments(int argc, char* argv[], Options& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		const string option = argv[i];
+		if(option == "--help" || option == "-h")
+			return false;
+		if(option == "--no-convergence")
+		{
+			options.convergence = false;
+			continue;
+		}
+		if(i + 1 >= argc)
+		{
+			cerr << "ERROR: " << option << " needs a value\n";
+			return false;
+		}
+		const char* value = argv[++i];
+		bool ok = true;
+		if(option == "--scene")
+		{
+			ok = false;
+			for(const BenchmarkScene& scene : scenes)
+			{
+				if(strcmp(scene.name, value) == 0)
+				{
+					options.scene = &scene;
+					ok = true;
+				}
+			}
+		}
+		else if(option == "--envmap")
+			options.envmap = value;
+		else if(option == "--size")
+			ok = sscanf(value, "%dx%d", &options.width, &options.height) == 2 && options.width > 0
+			     && options.height > 0;
+		else if(option == "--threads")
+			ok = parseList(value, options.threads);
+		else if(option == "--convergence-size")
+			ok = sscanf(value, "%dx%d", &options.convergence_width, &options.convergence_height) == 2
+			     && options.convergence_width > 0 && options.convergence_height > 0;
+		else if(option == "--reference")
+			options.reference = value;
+		else if(option == "--reference-spp")
+			ok = (options.reference_spp = atoi(value)) > 0;
+		else if(option == "--rmse")
+			ok = parseList(value, options.rmse_targets);
+		else if(option == "--time")
+			options.max_convergence_time = atof(value);
+		else
+		{
+			cerr << "ERROR: unknown option " << option << "\n";
+			return false;
+		}
+		if(!ok)
+		{
+			cerr << "ERROR: bad value for " << option << ": " << value << "\n";
+			return false;
+		}
+	}
+	if(options.threads.empty())
+	{
+		for(int t = 1; t < omp_get_max_threads(); t *= 2)
+		{
+			options.threads.push_back(t);
+		}
+		options.threads.push_back(omp_get_max_threads());
+	}
+	if(options.reference.empty())
+	{
+		options.reference = string("benchmark-") + options.scene->name + "-"
+		                    + to_string(options.convergence_width) + "x"
+		                    + to_string(options.convergence_height) + ".pfm";
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing. Every thread calls f() (which does ops_per_call operations) the
+// same number of times, doubled until the whole run takes MIN_TIME.
+// Returns wall-clock nanoseconds per operation.
+///////////////////////////////////////////////////////////////////////////////
+static const double MIN_TIME = 0.25;
+// Results go here, so that the compiler cannot drop the work
+static volatile float sink;
+
+template<typename F>
+static double nsPerOp(int threads, size_t ops_per_call, F f)
+{
+	for(size_t calls = 1;; calls *= 2)
+	{
+		const double start = omp_get_wtime();
+#pragma omp parallel num_threads(threads)
+		{
+			float sum = 0.0f;
+			for(size_t c = 0; c < calls; c++)
+			{
+				sum += f();
+			}
+			sink = sum;
+		}
+		const double elapsed = omp_get_wtime() - start;
+		if(elapsed >= MIN_TIME)
+			return 1e9 * elapsed / (double(calls) * double(ops_per_call) * threads);
+	}
+}
+
+static void report(const char* name, int threads, double ns)
+{
+	printf("  %-36s %3d threads %10.2f ns/op\n", name, threads, ns);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ray throughput. The rays are copied before every run, since tracing
+// changes them, and only the tracing is timed.
+///////////////////////////////////////////////////////////////////////////////
+static double raysPerSecond(int threads, const vector<Ray>& rays, bool occlusion, bool coherent)
+{
+	const int chunk = 256;
+	const int count = int(rays.size());
+	const int num_chunks = (count + chunk - 1) / chunk;
+	vector<Ray> work;
+	double elapsed = 0.0;
+	size_t traced = 0;
+	while(elapsed < MIN_TIME)
+	{
+		work = rays;
+		const double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+		for(int c = 0; c < num_chunks; c++)
+		{
+			const int first = c * chunk;
+			if(occlusion)
+				occluded(&work[first], std::min(chunk, count - first), coherent);
+			else
+				intersect(&work[first], std::min(chunk, count - first), coherent);
+		}
+		elapsed += omp_get_wtime() - start;
+		traced += rays.size();
+	}
+	return traced / elapsed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The rays of the benchmarks: one jittered camera ray per pixel, a shadow
+// ray towards the point light and a cosine distributed bounce from every
+// hit of those
+///////////////////////////////////////////////////////////////////////////////
+struct BenchmarkRays
+{
+	vector<Ray> primary;
+	vector<Ray> hits; // The primary rays that hit something, after tracing
+	vector<Ray> shadow;
+	vector<Ray> secondary;
+};
+
+static void generateRays(const Options& options, const mat4& V, const mat4& P, BenchmarkRays& rays)
+{
+	Camera camera;
+	camera.setup(V, P, options.width, options.height);
+	setSampler(SAMPLER_INDEPENDENT);
+	for(int y = 0; y < options.height; y++)
+	{
+		for(int x = 0; x < options.width; x++)
+		{
+			seedRandom(y * options.width + x, 0);
+			CameraSample sample;
+			sample.pixel = vec2(randf(), randf());
+			sample.lens = vec2(0.5f);
+			rays.primary.push_back(camera.generateRay(x, y, sample));
+		}
+	}
+	rays.hits = rays.primary;
+	intersect(rays.hits.data(), rays.hits.size(), true);
+	rays.hits.erase(
+	    remove_if(rays.hits.begin(), rays.hits.end(), [](const Ray& r) { return r.geomID == RTC_INVALID_GEOMETRY_ID; }),
+	    rays.hits.end());
+	for(size_t i = 0; i < rays.hits.size(); i++)
+	{
+		const Intersection hit = getIntersection(rays.hits[i]);
+		const vec3 to_light = point_light.position - hit.position;
+		const float distance_to_light = length(to_light);
+		const vec3 wl = to_light / distance_to_light;
+		rays.shadow.push_back(Ray(offsetRayOrigin(hit, wl), wl, 0.0f, distance_to_light));
+
+		seedRandom(uint32_t(i), 0, RANDOM_PATH);
+		const vec3 n = dot(hit.geometry_normal, hit.wo) > 0.0f ? hit.geometry_normal : -hit.geometry_normal;
+		const vec3 tangent = normalize(perpendicular(n));
+		const vec3 bitangent = normalize(cross(tangent, n));
+		const vec3 d = cosineSampleHemisphere();
+		const vec3 wi = normalize(d.x * tangent + d.y * bitangent + d.z * n);
+		rays.secondary.push_back(Ray(offsetRayOrigin(hit, wi), wi));
+	}
+}
+
+static void benchmarkRays(const Options& options, const BenchmarkRays& rays)
+{
+	printf("Ray throughput (%dx%d, %zu primary hits)\n", options.width, options.height, rays.hits.size());
+	const BVHBackend selected = settings.bvh_backend;
+	const char* backend_names[] = { "embree", "native" };
+	for(int b = 0; b < BVH_BACKEND_COUNT; b++)
+	{
+		if(!isBackendAvailable(BVHBackend(b)))
+			continue;
+		settings.bvh_backend = BVHBackend(b);
+		rebuildScene();
+		for(int threads : options.threads)
+		{
+			const double primary = raysPerSecond(threads, rays.primary, false, true);
+			const double shadow = raysPerSecond(threads, rays.shadow, true, false);
+			const double secondary = raysPerSecond(threads, rays.secondary, false, false);
+			printf("  %-8s %3d threads   primary %8.2f  shadow %8.2f  secondary %8.2f Mrays/s\n",
+			       backend_names[b], threads, primary / 1e6, shadow / 1e6, secondary / 1e6);
+		}
+	}
+	if(settings.bvh_backend != selected)
+	{
+		settings.bvh_backend = selected;
+		rebuildScene();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shading: attribute fetch and brdfs. The brdfs are evaluated for a fixed
+// set of random directions around random normals.
+///////////////////////////////////////////////////////////////////////////////
+static const int NUM_DIRECTIONS = 1024;
+
+struct Directions
+{
+	vec3 wi[NUM_DIRECTIONS], wo[NUM_DIRECTIONS], n[NUM_DIRECTIONS];
+};
+
+static vec3 randomDirection()
+{
+	const float z = 1.0f - 2.0f * randf();
+	const float r = sqrt(std::max(0.0f, 1.0f - z * z));
+	const float phi = 2.0f * M_PI * randf();
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+static void generateDirections(Directions& directions)
+{
+	setSampler(SAMPLER_INDEPENDENT);
+	seedRandom(0, 0);
+	for(int i = 0; i < NUM_DIRECTIONS; i++)
+	{
+		directions.n[i] = randomDirection();
+		// Mostly above the surface, like in a path
+		directions.wo[i] = randomDirection();
+		if(dot(directions.wo[i], directions.n[i]) < 0.0f)
+			directions.wo[i] = -directions.wo[i];
+		directions.wi[i] = randomDirection();
+	}
+}
+
+static labhelper::Material benchmarkMaterial(float reflectivity, float metalness)
+{
+	labhelper::Material material;
+	material.m_name = "benchmark";
+	material.m_color = vec3(0.8f, 0.5f, 0.3f);
+	material.m_reflectivity = reflectivity;
+	material.m_shininess = 100.0f;
+	material.m_metalness = metalness;
+	material.m_fresnel = 0.04f;
+	material.m_emission = 0.0f;
+	material.m_transparency = 0.0f;
+	return material;
+}
+
+static void benchmarkShading(const Options& options, const BenchmarkRays& rays)
+{
+	printf("Shading\n");
+	static Directions directions;
+	generateDirections(directions);
+	const Directions& dirs = directions;
+
+	struct NamedMaterial
+	{
+		const char* name;
+		labhelper::Material material;
+	};
+	const NamedMaterial materials[] = { { "diffuse", benchmarkMaterial(0.0f, 0.0f) },
+		                                { "metal", benchmarkMaterial(1.0f, 1.0f) },
+		                                { "layered", benchmarkMaterial(0.5f, 0.5f) } };
+
+	for(int threads : options.threads)
+	{
+		const size_t num_hits = rays.hits.size();
+		report("getIntersection", threads, nsPerOp(threads, num_hits, [&]() {
+			       float sum = 0.0f;
+			       for(size_t i = 0; i < num_hits; i++)
+			       {
+				       sum += getIntersection(rays.hits[i]).shading_normal.x;
+			       }
+			       return sum;
+		       }));
+
+		for(const NamedMaterial& m : materials)
+		{
+			MaterialTree tree(m.material);
+			BRDF& brdf = tree.brdf();
+			const MaterialRecord record = compileMaterial(m.material);
+			const string name = m.name;
+			report(("BRDF::f " + name).c_str(), threads, nsPerOp(threads, NUM_DIRECTIONS, [&]() {
+				       float sum = 0.0f;
+				       for(int i = 0; i < NUM_DIRECTIONS; i++)
+				       {
+					       sum += brdf.f(dirs.wi[i], dirs.wo[i], dirs.n[i]).x;
+				       }
+				       return sum;
+			       }));
+			report(("BRDF::sample_wi " + name).c_str(), threads, nsPerOp(threads, NUM_DIRECTIONS, [&]() {
+				       seedRandom(omp_get_thread_num(), 0);
+				       float sum = 0.0f;
+				       for(int i = 0; i < NUM_DIRECTIONS; i++)
+				       {
+					       vec3 wi;
+					       float p;
+					       sum += brdf.sample_wi(wi, dirs.wo[i], dirs.n[i], p).x + p;
+				       }
+				       return sum;
+			       }));
+			report(("materialF " + name).c_str(), threads, nsPerOp(threads, NUM_DIRECTIONS, [&]() {
+				       float sum = 0.0f;
+				       for(int i = 0; i < NUM_DIRECTIONS; i++)
+				       {
+					       sum += materialF(record, dirs.wi[i], dirs.wo[i], dirs.n[i]).x;
+				       }
+				       return sum;
+			       }));
+			report(("materialSampleWi " + name).c_str(), threads, nsPerOp(threads, NUM_DIRECTIONS, [&]() {
+				       seedRandom(omp_get_thread_num(), 0);
+				       float sum = 0.0f;
+				       for(int i = 0; i < NUM_DIRECTIONS; i++)
+				       {
+					       vec3 wi;
+					       float p;
+					       sum += materialSampleWi(record, wi, dirs.wo[i], dirs.n[i], p).x + p;
+				       }
+				       return sum;
+			       }));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The environment map and the sampling functions
+///////////////////////////////////////////////////////////////////////////////
+static void benchmarkSampling(const Options& options)
+{
+	printf("Sampling\n");
+	static const int N = 1024;
+	static vec2 uniform[N];
+	setSampler(SAMPLER_INDEPENDENT);
+	seedRandom(1, 0);
+	for(int i = 0; i < N; i++)
+	{
+		uniform[i] = vec2(randf(), randf());
+	}
+	const char* sampler_names[] = { "independent", "stratified", "halton", "sobol" };
+
+	for(int threads : options.threads)
+	{
+		report("HDRImage::sample", threads, nsPerOp(threads, N, [&]() {
+			       float sum = 0.0f;
+			       for(int i = 0; i < N; i++)
+			       {
+				       sum += environment.map.sample(uniform[i].x, uniform[i].y).x;
+			       }
+			       return sum;
+		       }));
+		report("HDRImage::sample_direction", threads, nsPerOp(threads, N, [&]() {
+			       float sum = 0.0f;
+			       for(int i = 0; i < N; i++)
+			       {
+				       float pdf;
+				       sum += environment.map.sample_direction(uniform[i].x, uniform[i].y, pdf).x + pdf;
+			       }
+			       return sum;
+		       }));
+		report("HDRImage::pdf", threads, nsPerOp(threads, N, [&]() {
+			       float sum = 0.0f;
+			       for(int i = 0; i < N; i++)
+			       {
+				       const float phi = 2.0f * M_PI * uniform[i].x;
+				       const float z = 1.0f - 2.0f * uniform[i].y;
+				       const float r = sqrt(1.0f - z * z);
+				       sum += environment.map.pdf(vec3(r * cos(phi), z, r * sin(phi)));
+			       }
+			       return sum;
+		       }));
+		for(int s = 0; s < SAMPLER_COUNT; s++)
+		{
+			setSampler(SamplerType(s));
+			// A sample of a path with a few bounces: seed, then 32 dimensions
+			report((string("seedRandom + randf ") + sampler_names[s]).c_str(), threads,
+			       nsPerOp(threads, 32 * N, [&]() {
+				       float sum = 0.0f;
+				       for(int i = 0; i < N; i++)
+				       {
+					       seedRandom(i, omp_get_thread_num());
+					       for(int d = 0; d < 32; d++)
+					       {
+						       sum += randf();
+					       }
+				       }
+				       return sum;
+			       }));
+		}
+		setSampler(SAMPLER_INDEPENDENT);
+		report("concentricSampleDisk", threads, nsPerOp(threads, N, [&]() {
+			       float sum = 0.0f;
+			       for(int i = 0; i < N; i++)
+			       {
+				       float x, y;
+				       concentricSampleDisk(uniform[i].x, uniform[i].y, &x, &y);
+				       sum += x + y;
+			       }
+			       return sum;
+		       }));
+		report("cosineSampleHemisphere", threads, nsPerOp(threads, N, [&]() {
+			       seedRandom(omp_get_thread_num(), 0);
+			       float sum = 0.0f;
+			       for(int i = 0; i < N; i++)
+			       {
+				       sum += cosineSampleHemisphere().z;
+			       }
+			       return sum;
+		       }));
+	}
+	setSampler(settings.sampler);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Convergence: render one sample per pixel at a time and measure how long
+// it takes to get within each RMSE of the reference image. Computing the
+// RMSE is not counted. The error is measured on colors clamped to [0, 1],
+// as the window shows them, or a few fireflies would decide it.
+///////////////////////////////////////////////////////////////////////////////
+static double rmse(const vector<vec3>& image, const vector<vec3>& reference)
+{
+	double sum = 0.0;
+	for(size_t i = 0; i < image.size(); i++)
+	{
+		const vec3 d = clamp(image[i], 0.0f, 1.0f) - clamp(reference[i], 0.0f, 1.0f);
+		sum += dot(d, d);
+	}
+	return sqrt(sum / (3.0 * image.size()));
+}
+
+static void benchmarkConvergence(const Options& options, const mat4& V)
+{
+	const int width = options.convergence_width, height = options.convergence_height;
+	const mat4 P = perspective(radians(45.0f), float(width) / float(height), 0.1f, 100.0f);
+	resize(width, height);
+
+	vector<vec3> reference;
+	int reference_width = 0, reference_height = 0;
+	if(!readPFM(options.reference, reference, reference_width, reference_height) || reference_width != width
+	   || reference_height != height)
+	{
+		// With the samples of the sampler that is measured, the image would
+		// converge to the noise of the reference
+		cerr << "Rendering the reference image (" << options.reference_spp << " spp)...";
+		settings.sampler = SAMPLER_INDEPENDENT;
+		for(int s = 0; s < options.reference_spp; s++)
+		{
+			tracePaths(V, P);
+		}
+		settings.sampler = SAMPLER_SOBOL;
+		reference = rendered_image.data;
+		if(!writeImage(options.reference, reference, width, height))
+			cerr << "could not write " << options.reference << ".\n";
+		cerr << "done.\n";
+		restart();
+	}
+
+	printf("Convergence (%dx%d, reference %s)\n", width, height, options.reference.c_str());
+	vector<double> target_time(options.rmse_targets.size(), -1.0);
+	vector<int> target_spp(options.rmse_targets.size(), 0);
+	double elapsed = 0.0;
+	size_t reached = 0;
+	for(int spp = 1; reached < options.rmse_targets.size() && elapsed < options.max_convergence_time; spp++)
+	{
+		const double start = omp_get_wtime();
+		tracePaths(V, P);
+		elapsed += omp_get_wtime() - start;
+		const double error = rmse(rendered_image.data, reference);
+		if((spp & (spp - 1)) == 0)
+			printf("  %6d spp %10.3f s   RMSE %.5f\n", spp, elapsed, error);
+		for(size_t t = 0; t < options.rmse_targets.size(); t++)
+		{
+			if(target_time[t] < 0.0 && error <= options.rmse_targets[t])
+			{
+				target_time[t] = elapsed;
+				target_spp[t] = spp;
+				reached++;
+			}
+		}
+	}
+	for(size_t t = 0; t < options.rmse_targets.size(); t++)
+	{
+		if(target_time[t] < 0.0)
+			printf("  RMSE %.4f not reached in %.1f s\n", options.rmse_targets[t], elapsed);
+		else
+			printf("  RMSE %.4f after %.3f s (%d spp)\n", options.rmse_targets[t], target_time[t], target_spp[t]);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	// Keep stdout for the results
+	cout.rdbuf(cerr.rdbuf());
+
+	Options options;
+	if(!parseArguments(argc, argv, options))
+	{
+		printUsage();
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The settings of the interactive pathtracer
+	///////////////////////////////////////////////////////////////////////////
+	settings.subsampling = 1;
+	settings.max_bounces = 8;
+	settings.max_paths_per_pixel = 0;
+	settings.tile_size = 16;
+	settings.tile_order = TILE_ORDER_MORTON;
+	settings.use_ray_packets = true;
+	settings.integrator = INTEGRATOR_PATH;
+	settings.antialiasing = true;
+	settings.lens_radius = 0.0f;
+	settings.focal_distance = 30.0f;
+	settings.adaptive_sampling = false;
+	settings.adaptive_threshold = 0.02f;
+	settings.sampler = SAMPLER_SOBOL;
+	settings.dynamic_geometry = false;
+	settings.rebuild_threshold = 1.5f;
+	settings.bvh_backend = isBackendAvailable(BVH_BACKEND_EMBREE) ? BVH_BACKEND_EMBREE : BVH_BACKEND_NATIVE;
+	settings.embree_scene_flags = 0;
+#ifdef PATHTRACER_EMBREE
+	settings.embree_algorithm_flags = RTC_INTERSECT1 | RTC_INTERSECT8 | RTC_INTERSECT_STREAM;
+#else
+	settings.embree_algorithm_flags = 0;
+#endif
+	settings.embree_threads = 0;
+	settings.denoise = false;
+	settings.denoise_iterations = 3;
+	settings.reprojection = false;
+	settings.max_history = 64;
+	settings.progressive = false;
+	settings.target_pass_time = 33.0f;
+	settings.primary_cache_samples = 0;
+
+	point_light.intensity_multiplier = 2500.0f;
+	point_light.color = vec3(1.0f, 1.0f, 1.0f);
+	point_light.position = vec3(10.0f, 40.0f, 10.0f);
+	environment.map.load(options.envmap);
+	environment.multiplier = 1.0f;
+
+	vector<labhelper::Model*> models;
+	for(const SceneModel& m : options.scene->models)
+	{
+		models.push_back(labhelper::loadModelFromOBJ(m.filename));
+		addModel(models.back(), translate(m.translation));
+	}
+	buildBVH();
+
+	const mat4 V = lookAt(options.scene->camera_position, options.scene->camera_target, vec3(0.0f, 1.0f, 0.0f));
+	const mat4 P = perspective(radians(45.0f), float(options.width) / float(options.height), 0.1f, 100.0f);
+	BenchmarkRays rays;
+	generateRays(options, V, P, rays);
+
+	printf("Scene %s, %d hardware threads\n", options.scene->name, omp_get_max_threads());
+	benchmarkRays(options, rays);
+	benchmarkShading(options, rays);
+	benchmarkSampling(options);
+	if(options.convergence)
+		benchmarkConvergence(options, V);
+
+	for(auto m : models)
+	{
+		labhelper::freeModel(m);
+	}
+	return 0;
+}
@@ -0,0 +1,675 @@
+#include "bvh.h"
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Build parameters. The costs are relative to intersecting a pack of four
+// triangles (or one instance), so a leaf costs one unit per pack.
+///////////////////////////////////////////////////////////////////////////
+static const int NUM_BINS = 16;
+static const float TRAVERSAL_COST = 1.0f;
+static const uint32_t MAX_LEAF_SIZE = 16;
+// Subtrees with more primitives than this are built as separate tasks
+static const uint32_t PARALLEL_BUILD_SIZE = 4096;
+// Deeper than this, nodes are split at the median, which keeps the tree
+// shallow
+static const int MAX_SAH_DEPTH = 40;
+// Nodes this deep are leaves whatever their size. traverse() pushes at most
+// one node per level, so its stack can never overflow.
+static const int STACK_SIZE = 64;
+
+struct AABB
+{
+	vec3 lo = vec3(FLT_MAX), hi = vec3(-FLT_MAX);
+	void grow(const vec3& p)
+	{
+		lo = min(lo, p);
+		hi = max(hi, p);
+	}
+	void grow(const AABB& b)
+	{
+		lo = min(lo, b.lo);
+		hi = max(hi, b.hi);
+	}
+	static AABB of(const BVHNode& node)
+	{
+		AABB box;
+		box.lo = node.lo;
+		box.hi = node.hi;
+		return box;
+	}
+	float area() const
+	{
+		const vec3 d = max(hi - lo, vec3(0.0f));
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Binned SAH builder, shared by both levels. Works on the bounds of the
+// primitives and leaves them in `order`, so that every leaf covers the
+// range [first, first + count) of it.
+///////////////////////////////////////////////////////////////////////////
+struct BuildState
+{
+	vector<AABB> bounds;
+	vector<vec3> centroids;
+	vector<uint32_t> order;
+	vector<BVHNode> nodes; // Allocated two at a time, in whatever order the tasks get there
+	atomic<uint32_t> num_nodes;
+	uint32_t pack_size;    // A leaf costs one unit per this many primitives
+};
+
+static float leafCost(const BuildState& state, uint32_t count)
+{
+	return float((count + state.pack_size - 1) / state.pack_size);
+}
+
+static void buildNode(BuildState& state, uint32_t index, uint32_t begin, uint32_t end, int depth)
+{
+	AABB box, centroid_box;
+	for(uint32_t i = begin; i < end; i++)
+	{
+		box.grow(state.bounds[state.order[i]]);
+		centroid_box.grow(state.centroids[state.order[i]]);
+	}
+	BVHNode& node = state.nodes[index];
+	node.lo = box.lo;
+	node.hi = box.hi;
+	node.first = begin;
+	node.count = end - begin;
+	const uint32_t count = end - begin;
+	if(count <= 1 || depth >= STACK_SIZE)
+		return;
+
+	///////////////////////////////////////////////////////////////////////
+	// Bin the centroids along all three axes and find the cheapest split
+	///////////////////////////////////////////////////////////////////////
+	const vec3 extent = centroid_box.hi - centroid_box.lo;
+	int best_axis = -1, best_bin = 0;
+	float best_cost = FLT_MAX;
+	vec3 scale(0.0f);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		if(extent[axis] > 0.0f)
+			scale[axis] = NUM_BINS * (1.0f - 1e-5f) / extent[axis];
+	}
+	if(depth < MAX_SAH_DEPTH)
+	{
+		AABB bins[3][NUM_BINS];
+		uint32_t counts[3][NUM_BINS] = {};
+		for(uint32_t i = begin; i < end; i++)
+		{
+			const uint32_t p = state.order[i];
+			const vec3 b = (state.centroids[p] - centroid_box.lo) * scale;
+			for(int axis = 0; axis < 3; axis++)
+			{
+				const int bin = std::min(NUM_BINS - 1, int(b[axis]));
+				bins[axis][bin].grow(state.bounds[p]);
+				counts[axis][bin]++;
+			}
+		}
+		const float inv_area = 1.0f / std::max(box.area(), FLT_MIN);
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(extent[axis] <= 0.0f)
+				continue;
+			// Sweep from the right to get the cost of everything right of a split
+			float right_cost[NUM_BINS];
+			AABB right;
+			uint32_t right_count = 0;
+			for(int bin = NUM_BINS - 1; bin > 0; bin--)
+			{
+				right.grow(bins[axis][bin]);
+				right_count += counts[axis][bin];
+				right_cost[bin] = right.area() * leafCost(state, right_count);
+			}
+			AABB left;
+			uint32_t left_count = 0;
+			for(int bin = 0; bin < NUM_BINS - 1; bin++)
+			{
+				left.grow(bins[axis][bin]);
+				left_count += counts[axis][bin];
+				if(left_count == 0 || left_count == count)
+					continue;
+				const float cost =
+				    TRAVERSAL_COST + (left.area() * leafCost(state, left_count) + right_cost[bin + 1]) * inv_area;
+				if(cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = bin;
+				}
+			}
+		}
+		if(count <= MAX_LEAF_SIZE && best_cost >= leafCost(state, count))
+			return;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Split, at the median of the widest axis if SAH found nothing
+	///////////////////////////////////////////////////////////////////////
+	uint32_t middle;
+	if(best_axis >= 0)
+	{
+		const float lo = centroid_box.lo[best_axis], s = scale[best_axis];
+		const vec3* centroids = state.centroids.data();
+		middle = uint32_t(partition(&state.order[begin], &state.order[0] + end,
+		                            [=](uint32_t p) {
+			                            const int bin = std::min(NUM_BINS - 1, int((centroids[p][best_axis] - lo) * s));
+			                            return bin <= best_bin;
+		                            })
+		                  - &state.order[0]);
+	}
+	else
+	{
+		if(count <= MAX_LEAF_SIZE)
+			return;
+		const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		const vec3* centroids = state.centroids.data();
+		middle = begin + count / 2;
+		nth_element(&state.order[begin], &state.order[middle], &state.order[0] + end,
+		            [=](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	}
+
+	const uint32_t left = state.num_nodes.fetch_add(2);
+	node.first = left;
+	node.count = 0;
+	if(count > PARALLEL_BUILD_SIZE)
+	{
+#pragma omp task shared(state)
+		buildNode(state, left, begin, middle, depth + 1);
+		buildNode(state, left + 1, middle, end, depth + 1);
+#pragma omp taskwait
+	}
+	else
+	{
+		buildNode(state, left, begin, middle, depth + 1);
+		buildNode(state, left + 1, middle, end, depth + 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Copy the tree depth first into `nodes`, with the children of a node
+// next to each other, followed by the subtree of the left one.
+///////////////////////////////////////////////////////////////////////////
+static void flatten(const BuildState& state, uint32_t from, vector<BVHNode>& nodes, uint32_t to)
+{
+	nodes[to] = state.nodes[from];
+	if(nodes[to].count > 0)
+		return;
+	const uint32_t left = uint32_t(nodes.size());
+	nodes.resize(nodes.size() + 2);
+	const uint32_t from_left = state.nodes[from].first;
+	nodes[to].first = left;
+	flatten(state, from_left, nodes, left);
+	flatten(state, from_left + 1, nodes, left + 1);
+}
+
+static void buildTree(BuildState& state, vector<BVHNode>& nodes, int num_threads)
+{
+	const uint32_t count = uint32_t(state.bounds.size());
+	state.order.resize(count);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		state.order[i] = i;
+	}
+	state.nodes.resize(std::max(1u, 2 * count));
+	state.num_nodes = 1;
+#pragma omp parallel num_threads(num_threads > 0 ? num_threads : omp_get_max_threads())
+#pragma omp single
+	buildNode(state, 0, 0, count, 0);
+	nodes.clear();
+	nodes.reserve(state.num_nodes);
+	nodes.resize(1);
+	flatten(state, 0, nodes, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A ray, ready for testing against boxes and packs of triangles. Zero
+// direction components are nudged so that the slab test never divides by
+// zero.
+///////////////////////////////////////////////////////////////////////////
+struct SSERay
+{
+	__m128 o, inv_d;                // For boxes, with w = 0
+	__m128 ox, oy, oz, dx, dy, dz; // For triangles, broadcast
+	float tnear;
+	SSERay(const vec3& origin, const vec3& direction, float near) : tnear(near)
+	{
+		vec3 d = direction;
+		for(int i = 0; i < 3; i++)
+		{
+			if(std::abs(d[i]) < 1e-20f)
+				d[i] = d[i] < 0.0f ? -1e-20f : 1e-20f;
+		}
+		o = _mm_set_ps(0.0f, origin.z, origin.y, origin.x);
+		inv_d = _mm_set_ps(0.0f, 1.0f / d.z, 1.0f / d.y, 1.0f / d.x);
+		ox = _mm_set1_ps(origin.x);
+		oy = _mm_set1_ps(origin.y);
+		oz = _mm_set1_ps(origin.z);
+		dx = _mm_set1_ps(direction.x);
+		dy = _mm_set1_ps(direction.y);
+		dz = _mm_set1_ps(direction.z);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Slab test of a node, with x, y and z in the lanes of one register. The
+// w lane holds the first/count of the node, and is masked away.
+///////////////////////////////////////////////////////////////////////////
+static inline bool hitBox(const BVHNode& node, const SSERay& ray, float tfar, float& dist)
+{
+	const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	const __m128 lo = _mm_and_ps(_mm_loadu_ps(&node.lo.x), xyz);
+	const __m128 hi = _mm_and_ps(_mm_loadu_ps(&node.hi.x), xyz);
+	const __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, ray.o), ray.inv_d);
+	const __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, ray.o), ray.inv_d);
+	const __m128 tmin = _mm_min_ps(t0, t1), tmax = _mm_max_ps(t0, t1);
+	__m128 enter = _mm_max_ss(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 1, 1, 1)));
+	enter = _mm_max_ss(enter, _mm_movehl_ps(tmin, tmin));
+	enter = _mm_max_ss(enter, _mm_set_ss(ray.tnear));
+	__m128 exit = _mm_min_ss(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 1, 1, 1)));
+	exit = _mm_min_ss(exit, _mm_movehl_ps(tmax, tmax));
+	exit = _mm_min_ss(exit, _mm_set_ss(tfar));
+	dist = _mm_cvtss_f32(enter);
+	return dist <= _mm_cvtss_f32(exit);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Walk the tree front to back. leaf(first, count) tests the primitives of
+// a leaf, shortens tfar when it finds a closer hit, and returns true to
+// stop the traversal (when any hit will do).
+///////////////////////////////////////////////////////////////////////////
+template<typename Leaf>
+static void traverse(const vector<BVHNode>& nodes, const SSERay& ray, float& tfar, Leaf leaf)
+{
+	struct Entry
+	{
+		uint32_t node;
+		float dist;
+	} stack[STACK_SIZE];
+	int top = 0;
+	float dist;
+	if(!hitBox(nodes[0], ray, tfar, dist))
+		return;
+	uint32_t index = 0;
+	while(true)
+	{
+		const BVHNode& node = nodes[index];
+		if(node.count > 0)
+		{
+			if(leaf(node.first, node.count))
+				return;
+		}
+		else
+		{
+			float d0, d1;
+			const bool h0 = hitBox(nodes[node.first], ray, tfar, d0);
+			const bool h1 = hitBox(nodes[node.first + 1], ray, tfar, d1);
+			if(h0 && h1)
+			{
+				const bool swap = d1 < d0;
+				stack[top].node = node.first + (swap ? 0 : 1);
+				stack[top].dist = swap ? d0 : d1;
+				top++;
+				index = node.first + (swap ? 1 : 0);
+				continue;
+			}
+			if(h0 || h1)
+			{
+				index = node.first + (h0 ? 0 : 1);
+				continue;
+			}
+		}
+		// Pop the next subtree that is still in front of the closest hit
+		do
+		{
+			if(top == 0)
+				return;
+			top--;
+		} while(stack[top].dist > tfar);
+		index = stack[top].node;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Moeller-Trumbore against the four triangles of a pack at once. Returns
+// a bit per lane that was hit in (tnear, tfar).
+///////////////////////////////////////////////////////////////////////////
+static inline int hitPack(const TrianglePack& p, const SSERay& ray, float tfar, __m128& t, __m128& u, __m128& v)
+{
+	const __m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+	const __m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+	const __m128 sx = _mm_sub_ps(ray.ox, _mm_loadu_ps(p.v0[0]));
+	const __m128 sy = _mm_sub_ps(ray.oy, _mm_loadu_ps(p.v0[1]));
+	const __m128 sz = _mm_sub_ps(ray.oz, _mm_loadu_ps(p.v0[2]));
+	// p = d x e2
+	const __m128 px = _mm_sub_ps(_mm_mul_ps(ray.dy, e2z), _mm_mul_ps(ray.dz, e2y));
+	const __m128 py = _mm_sub_ps(_mm_mul_ps(ray.dz, e2x), _mm_mul_ps(ray.dx, e2z));
+	const __m128 pz = _mm_sub_ps(_mm_mul_ps(ray.dx, e2y), _mm_mul_ps(ray.dy, e2x));
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	// q = s x e1
+	const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+	v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ray.dx, qx), _mm_mul_ps(ray.dy, qy)), _mm_mul_ps(ray.dz, qz)),
+	               inv_det);
+	t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 hit = _mm_cmpneq_ps(det, zero);
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, _mm_set1_ps(ray.tnear)));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(tfar)));
+	return _mm_movemask_ps(hit);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// BVH over the triangles of a model
+///////////////////////////////////////////////////////////////////////////
+void BVH::build(const vec3* positions, const vector<BVHMesh>& meshes, int num_threads)
+{
+	m_positions = positions;
+	m_meshes = meshes;
+	vector<uint32_t> geom_ids, prim_ids;
+	for(uint32_t m = 0; m < meshes.size(); m++)
+	{
+		for(uint32_t t = 0; t < meshes[m].num_triangles; t++)
+		{
+			geom_ids.push_back(m);
+			prim_ids.push_back(t);
+		}
+	}
+	const int num_triangles = int(geom_ids.size());
+	m_nodes.clear();
+	m_packs.clear();
+	if(num_triangles == 0)
+		return;
+	BuildState state;
+	state.pack_size = 4;
+	state.bounds.resize(num_triangles);
+	state.centroids.resize(num_triangles);
+#pragma omp parallel for num_threads(num_threads > 0 ? num_threads : omp_get_max_threads())
+	for(int i = 0; i < num_triangles; i++)
+	{
+		const uint32_t* index = m_meshes[geom_ids[i]].indices + 3 * prim_ids[i];
+		AABB& b = state.bounds[i];
+		b = AABB();
+		for(int j = 0; j < 3; j++)
+		{
+			b.grow(m_positions[index[j]]);
+		}
+		state.centroids[i] = 0.5f * (b.lo + b.hi);
+	}
+	buildTree(state, m_nodes, num_threads);
+
+	///////////////////////////////////////////////////////////////////////
+	// Pack the triangles of every leaf in fours, in the order of the nodes
+	///////////////////////////////////////////////////////////////////////
+	for(auto& node : m_nodes)
+	{
+		if(node.count == 0)
+			continue;
+		const uint32_t first_pack = uint32_t(m_packs.size());
+		for(uint32_t i = 0; i < node.count; i += 4)
+		{
+			TrianglePack pack;
+			for(uint32_t lane = 0; lane < 4; lane++)
+			{
+				const bool used = i + lane < node.count;
+				const uint32_t triangle = used ? state.order[node.first + i + lane] : 0;
+				pack.geomID[lane] = used ? geom_ids[triangle] : RTC_INVALID_GEOMETRY_ID;
+				pack.primID[lane] = used ? prim_ids[triangle] : RTC_INVALID_GEOMETRY_ID;
+			}
+			m_packs.push_back(pack);
+		}
+		node.first = first_pack;
+		node.count = uint32_t(m_packs.size()) - first_pack;
+	}
+	packTriangles(0, m_packs.size());
+}
+
+void BVH::packTriangles(size_t first_pack, size_t num_packs)
+{
+#pragma omp parallel for
+	for(int p = int(first_pack); p < int(first_pack + num_packs); p++)
+	{
+		TrianglePack& pack = m_packs[p];
+		for(int lane = 0; lane < 4; lane++)
+		{
+			vec3 v[3] = { vec3(0.0f), vec3(0.0f), vec3(0.0f) };
+			if(pack.geomID[lane] != RTC_INVALID_GEOMETRY_ID)
+			{
+				const uint32_t* index = m_meshes[pack.geomID[lane]].indices + 3 * pack.primID[lane];
+				for(int j = 0; j < 3; j++)
+				{
+					v[j] = m_positions[index[j]];
+				}
+			}
+			for(int axis = 0; axis < 3; axis++)
+			{
+				pack.v0[axis][lane] = v[0][axis];
+				pack.e1[axis][lane] = v[1][axis] - v[0][axis];
+				pack.e2[axis][lane] = v[2][axis] - v[0][axis];
+			}
+		}
+	}
+}
+
+void BVH::refit()
+{
+	if(m_packs.empty())
+		return;
+	packTriangles(0, m_packs.size());
+	// Children are stored after their parent, so walking backwards visits
+	// them first
+	for(size_t i = m_nodes.size(); i-- > 0;)
+	{
+		BVHNode& node = m_nodes[i];
+		AABB box;
+		if(node.count == 0)
+		{
+			box.grow(AABB::of(m_nodes[node.first]));
+			box.grow(AABB::of(m_nodes[node.first + 1]));
+		}
+		else
+		{
+			for(uint32_t p = node.first; p < node.first + node.count; p++)
+			{
+				const TrianglePack& pack = m_packs[p];
+				for(int lane = 0; lane < 4; lane++)
+				{
+					if(pack.geomID[lane] == RTC_INVALID_GEOMETRY_ID)
+						continue;
+					const vec3 v0(pack.v0[0][lane], pack.v0[1][lane], pack.v0[2][lane]);
+					box.grow(v0);
+					box.grow(v0 + vec3(pack.e1[0][lane], pack.e1[1][lane], pack.e1[2][lane]));
+					box.grow(v0 + vec3(pack.e2[0][lane], pack.e2[1][lane], pack.e2[2][lane]));
+				}
+			}
+		}
+		node.lo = box.lo;
+		node.hi = box.hi;
+	}
+}
+
+bool BVH::intersect(Ray& r) const
+{
+	if(m_packs.empty())
+		return false;
+	const SSERay ray(r.o, r.d, r.tnear);
+	const TrianglePack* hit_pack = nullptr;
+	int hit_lane = 0;
+	traverse(m_nodes, ray, r.tfar, [&](uint32_t first, uint32_t count) {
+		for(uint32_t p = first; p < first + count; p++)
+		{
+			__m128 t, u, v;
+			const int mask = hitPack(m_packs[p], ray, r.tfar, t, u, v);
+			if(mask == 0)
+				continue;
+			float ts[4], us[4], vs[4];
+			_mm_storeu_ps(ts, t);
+			_mm_storeu_ps(us, u);
+			_mm_storeu_ps(vs, v);
+			for(int lane = 0; lane < 4; lane++)
+			{
+				if((mask & (1 << lane)) && ts[lane] < r.tfar)
+				{
+					r.tfar = ts[lane];
+					r.u = us[lane];
+					r.v = vs[lane];
+					hit_pack = &m_packs[p];
+					hit_lane = lane;
+				}
+			}
+		}
+		return false;
+	});
+	if(hit_pack == nullptr)
+		return false;
+	// Like embree, Ng = (v0 - v1) x (v2 - v0), unnormalized
+	const vec3 e1(hit_pack->e1[0][hit_lane], hit_pack->e1[1][hit_lane], hit_pack->e1[2][hit_lane]);
+	const vec3 e2(hit_pack->e2[0][hit_lane], hit_pack->e2[1][hit_lane], hit_pack->e2[2][hit_lane]);
+	r.n = cross(e2, e1);
+	r.geomID = hit_pack->geomID[hit_lane];
+	r.primID = hit_pack->primID[hit_lane];
+	return true;
+}
+
+bool BVH::occluded(const Ray& r) const
+{
+	if(m_packs.empty())
+		return false;
+	const SSERay ray(r.o, r.d, r.tnear);
+	float tfar = r.tfar;
+	bool hit = false;
+	traverse(m_nodes, ray, tfar, [&](uint32_t first, uint32_t count) {
+		for(uint32_t p = first; p < first + count; p++)
+		{
+			__m128 t, u, v;
+			if(hitPack(m_packs[p], ray, tfar, t, u, v) != 0)
+			{
+				hit = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return hit;
+}
+
+size_t BVH::memory() const
+{
+	return m_nodes.size() * sizeof(BVHNode) + m_packs.size() * sizeof(TrianglePack);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// BVH over the instances, built from the boxes of their BVHs in world
+// space. Rays are moved into the space of an instance before testing it,
+// so (like with embree) the hit normal is in the space of the model.
+///////////////////////////////////////////////////////////////////////////
+void InstanceBVH::build(const vector<Instance>& instances)
+{
+	vector<Placed> placed;
+	BuildState state;
+	state.pack_size = 1;
+	for(uint32_t i = 0; i < instances.size(); i++)
+	{
+		const BVH* bvh = instances[i].bvh;
+		if(bvh == nullptr || bvh->empty())
+			continue;
+		AABB box;
+		for(int corner = 0; corner < 8; corner++)
+		{
+			const vec3 p((corner & 1) ? bvh->getHi().x : bvh->getLo().x, (corner & 2) ? bvh->getHi().y : bvh->getLo().y,
+			             (corner & 4) ? bvh->getHi().z : bvh->getLo().z);
+			box.grow(vec3(instances[i].transform * vec4(p, 1.0f)));
+		}
+		state.bounds.push_back(box);
+		state.centroids.push_back(0.5f * (box.lo + box.hi));
+		placed.push_back({ bvh, inverse(instances[i].transform), i });
+	}
+	m_instances.clear();
+	m_nodes.clear();
+	if(placed.empty())
+		return;
+	buildTree(state, m_nodes, 1);
+	for(uint32_t i = 0; i < placed.size(); i++)
+	{
+		m_instances.push_back(placed[state.order[i]]);
+	}
+}
+
+bool InstanceBVH::intersect(Ray& r) const
+{
+	if(m_nodes.empty())
+		return false;
+	const SSERay ray(r.o, r.d, r.tnear);
+	bool hit = false;
+	traverse(m_nodes, ray, r.tfar, [&](uint32_t first, uint32_t count) {
+		for(uint32_t i = first; i < first + count; i++)
+		{
+			const Placed& instance = m_instances[i];
+			Ray local = r;
+			local.o = vec3(instance.world_to_object * vec4(r.o, 1.0f));
+			local.d = mat3(instance.world_to_object) * r.d;
+			if(instance.bvh->intersect(local))
+			{
+				r.tfar = local.tfar;
+				r.n = local.n;
+				r.u = local.u;
+				r.v = local.v;
+				r.geomID = local.geomID;
+				r.primID = local.primID;
+				r.instID = instance.instID;
+				hit = true;
+			}
+		}
+		return false;
+	});
+	return hit;
+}
+
+bool InstanceBVH::occluded(const Ray& r) const
+{
+	if(m_nodes.empty())
+		return false;
+	const SSERay ray(r.o, r.d, r.tnear);
+	float tfar = r.tfar;
+	bool hit = false;
+	traverse(m_nodes, ray, tfar, [&](uint32_t first, uint32_t count) {
+		for(uint32_t i = first; i < first + count; i++)
+		{
+			const Placed& instance = m_instances[i];
+			Ray local = r;
+			local.o = vec3(instance.world_to_object * vec4(r.o, 1.0f));
+			local.d = mat3(instance.world_to_object) * r.d;
+			if(instance.bvh->occluded(local))
+			{
+				hit = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return hit;
+}
+
+size_t InstanceBVH::memory() const
+{
+	return m_nodes.size() * sizeof(BVHNode) + m_instances.size() * sizeof(Placed);
+}
+} // namespace pathtracer
@@ -0,0 +1,112 @@
+#pragma once
+#include "embree.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A node of the built-in BVH, 32 bytes so that two siblings share a cache
+// line. The nodes are stored depth first, with the two children of an
+// inner node next to each other.
+///////////////////////////////////////////////////////////////////////////
+struct BVHNode
+{
+	glm::vec3 lo;
+	uint32_t first; // Inner node: the left child (the right one follows). Leaf: first primitive
+	glm::vec3 hi;
+	uint32_t count; // Number of primitives in a leaf, 0 for inner nodes
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Four triangles, stored so that a ray can be tested against all of them
+// at once. Unused lanes are degenerate triangles that are never hit.
+///////////////////////////////////////////////////////////////////////////
+struct TrianglePack
+{
+	float v0[3][4];
+	float e1[3][4]; // v1 - v0
+	float e2[3][4]; // v2 - v0
+	uint32_t geomID[4];
+	uint32_t primID[4];
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A mesh of triangles, indexing into the positions of the BVH. Like in
+// embree, the geomID of a mesh is its index in the list the BVH is built
+// from, and the primID of a triangle is its index in the mesh.
+///////////////////////////////////////////////////////////////////////////
+struct BVHMesh
+{
+	const uint32_t* indices;
+	uint32_t num_triangles;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The built-in alternative to an embree scene of triangle meshes. Built
+// with binned SAH, with the subtrees built in parallel. The BVH reads the
+// positions and indices from the buffers it was built from, which must
+// stay where they are.
+///////////////////////////////////////////////////////////////////////////
+class BVH
+{
+public:
+	// With num_threads threads, 0 = one per hardware thread
+	void build(const glm::vec3* positions, const std::vector<BVHMesh>& meshes, int num_threads = 0);
+	// Move the triangles to the current positions, keeping the tree
+	void refit();
+	// Like rtcIntersect() and rtcOccluded() on a single ray
+	bool intersect(Ray& r) const;
+	bool occluded(const Ray& r) const;
+
+	bool empty() const
+	{
+		return m_packs.empty();
+	}
+	const glm::vec3& getLo() const
+	{
+		return m_nodes[0].lo;
+	}
+	const glm::vec3& getHi() const
+	{
+		return m_nodes[0].hi;
+	}
+	size_t memory() const;
+
+private:
+	void packTriangles(size_t first_pack, size_t num_packs);
+
+	const glm::vec3* m_positions = nullptr;
+	std::vector<BVHMesh> m_meshes;
+	std::vector<BVHNode> m_nodes;
+	std::vector<TrianglePack> m_packs;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The top level: a BVH over instances of BVHs. Instance i is hit with
+// instID i, and ids without a BVH are skipped.
+///////////////////////////////////////////////////////////////////////////
+class InstanceBVH
+{
+public:
+	struct Instance
+	{
+		const BVH* bvh;
+		glm::mat4 transform;
+	};
+	void build(const std::vector<Instance>& instances);
+	bool intersect(Ray& r) const;
+	bool occluded(const Ray& r) const;
+	size_t memory() const;
+
+private:
+	struct Placed
+	{
+		const BVH* bvh;
+		glm::mat4 world_to_object;
+		uint32_t instID;
+	};
+	std::vector<BVHNode> m_nodes;
+	std::vector<Placed> m_instances; // In the order of the leaves
+};
+} // namespace pathtracer
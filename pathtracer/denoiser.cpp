@@ -0,0 +1,315 @@
+#include "denoiser.h"
+#include "Pathtracer.h"
+#include <algorithm>
+#include <emmintrin.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Filter parameters, as in the SVGF paper except for the luminance. With
+// the paper's 4, the wider passes blurred away more detail than noise
+// once the image had more than a handful of samples.
+///////////////////////////////////////////////////////////////////////////
+static const float SIGMA_LUMINANCE = 2.0f;
+static const float SIGMA_NORMAL = 128.0f; // Applied as seven squarings, see normalWeight()
+static const float SIGMA_DEPTH = 1.0f;
+static const int MAX_ITERATIONS = 5;
+// Below this many samples, the variance of a pixel is estimated from its
+// neighbours instead
+static const int MIN_VARIANCE_SAMPLES = 4;
+
+///////////////////////////////////////////////////////////////////////////
+// The filter works on planes of floats with PADDING pixels around the
+// image, so that the widest kernel (2 * 2^(MAX_ITERATIONS - 1) pixels)
+// never has to check the borders. The padding has no normal, which gives
+// it zero weight. Four pixels of a row are filtered at once.
+///////////////////////////////////////////////////////////////////////////
+static const int PADDING = 2 << (MAX_ITERATIONS - 1);
+
+struct Planes
+{
+	int width = 0, height = 0, stride = 0;
+	// Illumination (color with the albedo divided out) and its variance,
+	// twice so that every pass reads one and writes the other
+	vector<float> r[2], g[2], b[2], variance[2];
+	vector<float> blurred_variance;
+	vector<float> nx, ny, nz, depth, depth_gradient;
+	int index(int x, int y) const
+	{
+		return (y + PADDING) * stride + x + PADDING;
+	}
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		stride = (width + 2 * PADDING + 3) & ~3;
+		const size_t size = size_t(stride) * (height + 2 * PADDING);
+		for(vector<float>* plane : { &r[0], &g[0], &b[0], &variance[0], &r[1], &g[1], &b[1], &variance[1],
+		                             &blurred_variance, &nx, &ny, &nz, &depth, &depth_gradient })
+		{
+			plane->assign(size, 0.0f);
+		}
+	}
+};
+static Planes planes;
+
+///////////////////////////////////////////////////////////////////////////
+// Divide the albedo out of the color of a pixel. Very dark albedos (and
+// misses) are left alone, so that they do not blow up.
+///////////////////////////////////////////////////////////////////////////
+static vec3 demodulation(const vec3& albedo)
+{
+	return vec3(albedo.x > 0.01f ? albedo.x : 1.0f, albedo.y > 0.01f ? albedo.y : 1.0f,
+	            albedo.z > 0.01f ? albedo.z : 1.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fill the planes from rendered_image. The variance of a pixel is that of
+// the mean of its luminance, from the running variance of the image once
+// there are enough samples, and from its 3x3 neighbourhood before that.
+///////////////////////////////////////////////////////////////////////////
+static void loadPlanes()
+{
+	const Image& image = rendered_image;
+	if(planes.width != image.width || planes.height != image.height)
+		planes.resize(image.width, image.height);
+#pragma omp parallel for
+	for(int y = 0; y < image.height; y++)
+	{
+		for(int x = 0; x < image.width; x++)
+		{
+			const int pixel = y * image.width + x;
+			const int i = planes.index(x, y);
+			const vec3 illumination = image.data[pixel] / demodulation(image.albedo[pixel]);
+			planes.r[0][i] = illumination.x;
+			planes.g[0][i] = illumination.y;
+			planes.b[0][i] = illumination.z;
+			const vec3& n = image.normal[pixel];
+			const float length2 = dot(n, n);
+			const vec3 normal = length2 > 0.0f ? n / sqrt(length2) : vec3(0.0f);
+			planes.nx[i] = normal.x;
+			planes.ny[i] = normal.y;
+			planes.nz[i] = normal.z;
+			planes.depth[i] = image.depth[pixel];
+		}
+	}
+#pragma omp parallel for
+	for(int y = 0; y < image.height; y++)
+	{
+		for(int x = 0; x < image.width; x++)
+		{
+			const int pixel = y * image.width + x;
+			const int i = planes.index(x, y);
+			const int n = image.sample_count[pixel];
+			const float albedo_luminance = Image::luminance(demodulation(image.albedo[pixel]));
+			float variance;
+			if(n >= MIN_VARIANCE_SAMPLES)
+			{
+				variance = image.luminance_m2[pixel] / float(n - 1) / float(n);
+				variance /= albedo_luminance * albedo_luminance;
+			}
+			else
+			{
+				float sum = 0.0f, sum2 = 0.0f;
+				for(int dy = -1; dy <= 1; dy++)
+				{
+					for(int dx = -1; dx <= 1; dx++)
+					{
+						const int j = i + dy * planes.stride + dx;
+						const float l = Image::luminance(vec3(planes.r[0][j], planes.g[0][j], planes.b[0][j]));
+						sum += l;
+						sum2 += l * l;
+					}
+				}
+				variance = std::max(0.0f, sum2 / 9.0f - (sum / 9.0f) * (sum / 9.0f)) / float(std::max(1, n));
+			}
+			planes.variance[0][i] = variance;
+			const float* depth = &planes.depth[i];
+			planes.depth_gradient[i] = std::max(std::max(std::abs(depth[1] - depth[0]), std::abs(depth[0] - depth[-1])),
+			                                    std::max(std::abs(depth[planes.stride] - depth[0]),
+			                                             std::abs(depth[0] - depth[-planes.stride])));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// exp(x) for x <= 0, accurate to about 1e-4, four at a time
+///////////////////////////////////////////////////////////////////////////
+static inline __m128 expNegative(__m128 x)
+{
+	const __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+	// floor(t), for negative t as well
+	__m128 i = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+	i = _mm_sub_ps(i, _mm_and_ps(_mm_cmplt_ps(t, i), _mm_set1_ps(1.0f)));
+	const __m128 f = _mm_sub_ps(t, i);
+	// 2^f on [0, 1)
+	__m128 p = _mm_set1_ps(0.0096181f);
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.2402265f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.6931472f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+	const __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(i), _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// max(0, dot(n_p, n_q))^128
+///////////////////////////////////////////////////////////////////////////
+static inline __m128 normalWeight(__m128 d)
+{
+	d = _mm_max_ps(d, _mm_setzero_ps());
+	for(int i = 0; i < 7; i++)
+	{
+		d = _mm_mul_ps(d, d);
+	}
+	return d;
+}
+
+static inline __m128 luminance(__m128 r, __m128 g, __m128 b)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+	                  _mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+}
+
+static inline __m128 absolute(__m128 x)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// One pass of the filter, with the taps `step` pixels apart, from planes
+// [from] to planes [1 - from].
+///////////////////////////////////////////////////////////////////////////
+static void filterPass(int step, int from)
+{
+	static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	const int to = 1 - from;
+	const int stride = planes.stride;
+
+	///////////////////////////////////////////////////////////////////////
+	// The luminance weight uses the variance blurred over 3x3 pixels,
+	// which is less noisy than that of the pixel alone
+	///////////////////////////////////////////////////////////////////////
+	const vector<float>& variance = planes.variance[from];
+#pragma omp parallel for
+	for(int y = 0; y < planes.height; y++)
+	{
+		for(int x = 0; x < planes.width; x++)
+		{
+			const int i = planes.index(x, y);
+			float sum = 0.0f;
+			for(int dy = -1; dy <= 1; dy++)
+			{
+				const float* row = &variance[i + dy * stride];
+				sum += (dy == 0 ? 0.5f : 0.25f) * (0.25f * row[-1] + 0.5f * row[0] + 0.25f * row[1]);
+			}
+			planes.blurred_variance[i] = sum;
+		}
+	}
+
+	const float* r = planes.r[from].data();
+	const float* g = planes.g[from].data();
+	const float* b = planes.b[from].data();
+	const float* v = variance.data();
+	const float* nx = planes.nx.data();
+	const float* ny = planes.ny.data();
+	const float* nz = planes.nz.data();
+	const float* depth = planes.depth.data();
+	const __m128 zero = _mm_setzero_ps();
+#pragma omp parallel for schedule(dynamic, 4)
+	for(int y = 0; y < planes.height; y++)
+	{
+		for(int x = 0; x < planes.width; x += 4)
+		{
+			const int p = planes.index(x, y);
+			const __m128 r_p = _mm_loadu_ps(r + p), g_p = _mm_loadu_ps(g + p), b_p = _mm_loadu_ps(b + p);
+			const __m128 nx_p = _mm_loadu_ps(nx + p), ny_p = _mm_loadu_ps(ny + p), nz_p = _mm_loadu_ps(nz + p);
+			const __m128 depth_p = _mm_loadu_ps(depth + p);
+			const __m128 luminance_p = luminance(r_p, g_p, b_p);
+			const __m128 luminance_scale = _mm_div_ps(
+			    _mm_set1_ps(1.0f),
+			    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SIGMA_LUMINANCE),
+			                          _mm_sqrt_ps(_mm_max_ps(_mm_loadu_ps(&planes.blurred_variance[p]), zero))),
+			               _mm_set1_ps(1e-4f)));
+			// The depth may change by the gradient times the distance to the tap,
+			// which is the square root of dx^2 + dy^2 = 1, 2, 4, 5 or 8
+			const __m128 depth_scale =
+			    _mm_mul_ps(_mm_loadu_ps(&planes.depth_gradient[p]), _mm_set1_ps(SIGMA_DEPTH * float(step)));
+			__m128 depth_inv[9];
+			for(int d2 : { 1, 2, 4, 5, 8 })
+			{
+				depth_inv[d2] = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_mul_ps(depth_scale, _mm_set1_ps(sqrt(float(d2)))),
+				                                                     _mm_set1_ps(1e-4f)));
+			}
+			// The center tap always gets its full weight
+			const __m128 center = _mm_set1_ps(kernel[2] * kernel[2]);
+			__m128 sum_w = center;
+			__m128 sum_r = _mm_mul_ps(center, r_p), sum_g = _mm_mul_ps(center, g_p), sum_b = _mm_mul_ps(center, b_p);
+			__m128 sum_v = _mm_mul_ps(_mm_mul_ps(center, center), _mm_loadu_ps(v + p));
+			for(int dy = -2; dy <= 2; dy++)
+			{
+				for(int dx = -2; dx <= 2; dx++)
+				{
+					if(dx == 0 && dy == 0)
+						continue;
+					const int q = p + step * (dy * stride + dx);
+					const __m128 r_q = _mm_loadu_ps(r + q), g_q = _mm_loadu_ps(g + q), b_q = _mm_loadu_ps(b + q);
+					const __m128 cosine = _mm_add_ps(
+					    _mm_add_ps(_mm_mul_ps(nx_p, _mm_loadu_ps(nx + q)), _mm_mul_ps(ny_p, _mm_loadu_ps(ny + q))),
+					    _mm_mul_ps(nz_p, _mm_loadu_ps(nz + q)));
+					const __m128 luminance_term =
+					    _mm_mul_ps(absolute(_mm_sub_ps(luminance_p, luminance(r_q, g_q, b_q))), luminance_scale);
+					const __m128 depth_term =
+					    _mm_mul_ps(absolute(_mm_sub_ps(depth_p, _mm_loadu_ps(depth + q))), depth_inv[dx * dx + dy * dy]);
+					const __m128 w =
+					    _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]), normalWeight(cosine)),
+					               expNegative(_mm_sub_ps(zero, _mm_add_ps(luminance_term, depth_term))));
+					sum_w = _mm_add_ps(sum_w, w);
+					sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, r_q));
+					sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, g_q));
+					sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, b_q));
+					sum_v = _mm_add_ps(sum_v, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(v + q)));
+				}
+			}
+			const __m128 inv_w = _mm_div_ps(_mm_set1_ps(1.0f), sum_w);
+			_mm_storeu_ps(&planes.r[to][p], _mm_mul_ps(sum_r, inv_w));
+			_mm_storeu_ps(&planes.g[to][p], _mm_mul_ps(sum_g, inv_w));
+			_mm_storeu_ps(&planes.b[to][p], _mm_mul_ps(sum_b, inv_w));
+			_mm_storeu_ps(&planes.variance[to][p], _mm_mul_ps(sum_v, _mm_mul_ps(inv_w, inv_w)));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Filter rendered_image and multiply the albedo back in
+///////////////////////////////////////////////////////////////////////////
+void denoise(std::vector<glm::vec3>& result)
+{
+	const Image& image = rendered_image;
+	result.resize(image.width * image.height);
+	if(result.empty())
+		return;
+	loadPlanes();
+	const int iterations = std::max(1, std::min(MAX_ITERATIONS, settings.denoise_iterations));
+	int from = 0;
+	for(int i = 0; i < iterations; i++)
+	{
+		filterPass(1 << i, from);
+		from = 1 - from;
+	}
+#pragma omp parallel for
+	for(int y = 0; y < image.height; y++)
+	{
+		for(int x = 0; x < image.width; x++)
+		{
+			const int pixel = y * image.width + x;
+			const int i = planes.index(x, y);
+			result[pixel] =
+			    vec3(planes.r[from][i], planes.g[from][i], planes.b[from][i]) * demodulation(image.albedo[pixel]);
+		}
+	}
+}
+} // namespace pathtracer
@@ -0,0 +1,17 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Denoise rendered_image for display with an edge-avoiding a-trous
+// wavelet filter (the spatial part of SVGF, Schied et al. 2017). The
+// first-hit albedo is divided out before filtering and multiplied back
+// afterwards, and the filter does not blur across edges in the first-hit
+// normal and depth, or across differences in luminance that the variance
+// of the pixels does not explain. Runs settings.denoise_iterations passes
+// of a 5x5 kernel, spread twice as wide in every pass.
+///////////////////////////////////////////////////////////////////////////
+void denoise(std::vector<glm::vec3>& result);
+} // namespace pathtracer
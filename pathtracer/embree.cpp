@@ -1,6 +1,14 @@
 #include "embree.h"
+#include "bvh.h"
+#include "material.h"
 #include <iostream>
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <glm/gtc/matrix_inverse.hpp>
 
 
 using namespace std;
@@ -11,19 +19,158 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 // Global variables
 ///////////////////////////////////////////////////////////////////////////
+#ifdef PATHTRACER_EMBREE
 RTCDevice embree_device;
 RTCScene embree_scene;
+// Bytes currently allocated by embree (BVHs and any buffers it owns)
+static atomic<int64_t> embree_memory(0);
+// Build progress of the current commit, in percent
+static atomic<int> build_progress(0);
+static bool print_progress = false;
+// The settings the current device and scenes were created with
+static unsigned embree_scene_flags = 0;
+static RTCAlgorithmFlags embree_algorithm_flags = RTC_INTERSECT1;
+#endif
+static int embree_threads = 0;
+static BVHBackend bvh_backend = BVH_BACKEND_NATIVE;
+// The top level of the scene, when the built-in BVH is used
+static InstanceBVH instance_bvh;
+
+bool isBackendAvailable(BVHBackend backend)
+{
+#ifdef PATHTRACER_EMBREE
+	return backend == BVH_BACKEND_EMBREE || backend == BVH_BACKEND_NATIVE;
+#else
+	return backend == BVH_BACKEND_NATIVE;
+#endif
+}
+
+static bool usingEmbree()
+{
+	return bvh_backend == BVH_BACKEND_EMBREE;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Everything getIntersection() needs to know about a mesh, with the
+// pointers already offset to its first vertex in the model.
+///////////////////////////////////////////////////////////////////////////
+struct GeometryRecord
+{
+	const vec3* normals;
+	const vec2* texture_coordinates; // nullptr if the model has none
+	const labhelper::Material* material;
+	uint32_t material_index; // Into material_table
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The geometry of one Model as the BVH sees it. The positions are welded
+// (every distinct position is stored once) and indexed, and embree (or the
+// built-in BVH) reads them straight from these buffers instead of keeping
+// its own copy. The index buffer keeps the triangle order of the model, so
+// a primID still finds the normals and texture coordinates of its
+// triangle in the model.
+///////////////////////////////////////////////////////////////////////////
+struct ModelGeometry
+{
+	const labhelper::Model* model;
+	vector<vec3> positions; // One extra vertex of padding, see rtcSetBuffer2()
+	vector<uint32_t> indices;
+	vector<GeometryRecord> records; // Indexed by the geomID of the mesh
+	uint32_t first_material;        // Of the model in material_table
+#ifdef PATHTRACER_EMBREE
+	RTCScene scene; // Holds the meshes, shared by all instances
+#endif
+	BVH bvh;                        // Used instead of the scene with BVH_BACKEND_NATIVE
+	bool dynamic;                   // Whether the scene can be refit
+	float built_quality;            // clusterArea() when the BVH was last built
+	size_t memory() const
+	{
+		return positions.size() * sizeof(vec3) + indices.size() * sizeof(uint32_t);
+	}
+};
+static vector<unique_ptr<ModelGeometry>> model_geometries;
+
+///////////////////////////////////////////////////////////////////////////
+// A model placed in the scene. The top level scene instances the scene of
+// the model with the model matrix, so a model that is added many times is
+// only stored and built once. Indexed by the instID embree reports.
+///////////////////////////////////////////////////////////////////////////
+struct Instance
+{
+	ModelGeometry* geometry;
+	mat4 transform;
+	mat3 normal_matrix;
+};
+static vector<Instance> instances;
+
+static CommitStats commit_stats;
+static uint32_t scene_version = 0;
+
+///////////////////////////////////////////////////////////////////////////
+// Bytes allocated for the BVHs of the current backend
+///////////////////////////////////////////////////////////////////////////
+static int64_t bvhMemory()
+{
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+		return embree_memory;
+#endif
+	size_t memory = instance_bvh.memory();
+	for(auto& geometry : model_geometries)
+	{
+		memory += geometry->bvh.memory();
+	}
+	return int64_t(memory);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the top level of the built-in BVH over the instances
+///////////////////////////////////////////////////////////////////////////
+static void buildInstanceBVH()
+{
+	vector<InstanceBVH::Instance> bvh_instances(instances.size());
+	for(size_t i = 0; i < instances.size(); i++)
+	{
+		bvh_instances[i].bvh = instances[i].geometry != nullptr ? &instances[i].geometry->bvh : nullptr;
+		bvh_instances[i].transform = instances[i].transform;
+	}
+	instance_bvh.build(bvh_instances);
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Build an acceleration structure for the scene
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH()
 {
-	cout << "Embree building BVH..." << flush;
-	rtcCommit(embree_scene);
-	cout << "done.\n";
+	cout << (usingEmbree() ? "Embree building BVH..." : "Building BVH...") << flush;
+	const double start = omp_get_wtime();
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		build_progress = 0;
+		print_progress = true;
+		rtcCommit(embree_scene);
+		print_progress = false;
+	}
+#endif
+	if(!usingEmbree())
+		buildInstanceBVH();
+	scene_version++;
+	commit_stats.time = omp_get_wtime() - start;
+	commit_stats.refit = false;
+	commit_stats.quality = 1.0f;
+	commit_stats.memory = bvhMemory();
+	cout << "done (" << 1000.0 * commit_stats.time << " ms).\n";
+	size_t buffer_memory = 0;
+	for(auto& geometry : model_geometries)
+	{
+		buffer_memory += geometry->memory();
+	}
+	cout << "BVH memory: " << commit_stats.memory / (1024.0 * 1024.0)
+	     << " MB, shared vertex/index buffers: " << buffer_memory / (1024.0 * 1024.0) << " MB\n";
 }
 
+#ifdef PATHTRACER_EMBREE
 ///////////////////////////////////////////////////////////////////////////
 // Called when there is an embree error
 ///////////////////////////////////////////////////////////////////////////
@@ -34,75 +181,484 @@ void embreeErrorHandler(const RTCError code, const char* str)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Called whenever embree allocates (bytes > 0) or frees memory
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+static bool embreeMemoryMonitor(void* ptr, const ssize_t bytes, const bool post)
+{
+	embree_memory += bytes;
+	return true;
+}
 
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Called while embree builds a BVH, with n going from 0 to 1. Possibly
+// from several threads at once.
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+static bool embreeProgressMonitor(void* ptr, const double n)
 {
-	///////////////////////////////////////////////////////////////////////
-	// Lazy initialize embree on first use
-	///////////////////////////////////////////////////////////////////////
-	cout << "Initializing embree..." << flush;
-	static bool embree_is_initialized = false;
-	if(!embree_is_initialized)
+	const int percent = int(100.0 * n);
+	int previous = build_progress;
+	while(percent / 10 > previous / 10)
 	{
-		embree_is_initialized = true;
-		embree_device = rtcNewDevice();
-		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
-		embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+		if(build_progress.compare_exchange_weak(previous, percent))
+		{
+			if(print_progress)
+				cout << percent << "%..." << flush;
+			break;
+		}
 	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Create the embree device, with as many threads as settings.embree_threads
+// says (0 means one per hardware thread).
+///////////////////////////////////////////////////////////////////////////
+static void createDevice()
+{
+	const string config = "threads=" + to_string(std::max(0, embree_threads));
+	embree_device = rtcNewDevice(config.c_str());
+	rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
+	rtcDeviceSetMemoryMonitorFunction2(embree_device, embreeMemoryMonitor, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Create a scene with the scene and algorithm flags from the settings.
+// The packet and stream functions are only used if the scene was created
+// with their algorithm flag.
+///////////////////////////////////////////////////////////////////////////
+static RTCScene newScene(bool dynamic)
+{
+	const unsigned flags = embree_scene_flags | (dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC);
+	RTCScene scene = rtcDeviceNewScene(embree_device, RTCSceneFlags(flags), embree_algorithm_flags);
+	rtcSetProgressMonitorFunction(scene, embreeProgressMonitor, nullptr);
+	return scene;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Take the backend, embree flags and number of threads from the settings.
+// A backend that was not built in falls back to the built-in BVH.
+///////////////////////////////////////////////////////////////////////////
+static void applySceneSettings()
+{
+	bvh_backend = isBackendAvailable(settings.bvh_backend) ? settings.bvh_backend : BVH_BACKEND_NATIVE;
+	embree_threads = settings.embree_threads;
+#ifdef PATHTRACER_EMBREE
+	embree_scene_flags = settings.embree_scene_flags;
+	embree_algorithm_flags = RTCAlgorithmFlags(settings.embree_algorithm_flags | RTC_INTERSECT1);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Lazy initialize embree on first use
+///////////////////////////////////////////////////////////////////////////
+static void initializeEmbree()
+{
+	static bool embree_is_initialized = false;
+	if(embree_is_initialized)
+		return;
+	embree_is_initialized = true;
+	applySceneSettings();
+#ifdef PATHTRACER_EMBREE
+	cout << "Initializing embree..." << flush;
+	createDevice();
+	// The top level only holds instances, and is rebuilt when they move
+	if(usingEmbree())
+		embree_scene = newScene(true);
 	cout << "done.\n";
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Weld the positions of a model into an indexed vertex buffer, compile
+// its materials and build a scene of its meshes. Done once per model.
+///////////////////////////////////////////////////////////////////////////
+struct PositionHash
+{
+	size_t operator()(const vec3& p) const
+	{
+		uint32_t bits[3];
+		memcpy(bits, &p, sizeof(bits));
+		return size_t(bits[0]) * 73856093u ^ size_t(bits[1]) * 19349663u ^ size_t(bits[2]) * 83492791u;
+	}
+};
+
+static void compileMaterials(ModelGeometry& geometry);
+static void buildModelScene(ModelGeometry& geometry);
+
+static ModelGeometry* getModelGeometry(const labhelper::Model* model)
+{
+	for(auto& geometry : model_geometries)
+	{
+		if(geometry->model == model)
+			return geometry.get();
+	}
+	ModelGeometry* geometry = new ModelGeometry;
+	model_geometries.emplace_back(geometry);
+	geometry->model = model;
 
-	///////////////////////////////////////////////////////////////////////
-	// Transform and add each mesh in the model as a geometry in embree,
-	// and create mappings so that we can connect an embree geom_ID to a
-	// Material.
-	///////////////////////////////////////////////////////////////////////
-	cout << "Adding " << model->m_name << " to embree scene..." << flush;
+	unordered_map<vec3, uint32_t, PositionHash> welded;
+	welded.reserve(model->m_positions.size());
+	geometry->indices.resize(model->m_positions.size());
+	for(size_t i = 0; i < model->m_positions.size(); i++)
+	{
+		auto it = welded.insert(make_pair(model->m_positions[i], uint32_t(geometry->positions.size())));
+		if(it.second)
+			geometry->positions.push_back(model->m_positions[i]);
+		geometry->indices[i] = it.first->second;
+	}
+	// Embree reads vertices with 16 byte loads, so the last one needs padding
+	geometry->positions.push_back(vec3(0.0f));
+	geometry->positions.shrink_to_fit();
+
+	geometry->first_material = uint32_t(material_table.size());
+	material_table.resize(material_table.size() + model->m_materials.size());
 	for(auto& mesh : model->m_meshes)
 	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-		map_geom_ID_to_mesh[geom_ID] = &mesh;
-		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		GeometryRecord record;
+		record.normals = &model->m_normals[mesh.m_start_index];
+		record.texture_coordinates = nullptr;
+		if(model->m_texture_coordinates.size() >= mesh.m_start_index + mesh.m_number_of_vertices)
+			record.texture_coordinates = &model->m_texture_coordinates[mesh.m_start_index];
+		geometry->records.push_back(record);
+	}
+	compileMaterials(*geometry);
+
+	buildModelScene(*geometry);
+	return geometry;
+}
+
+#ifdef PATHTRACER_EMBREE
+///////////////////////////////////////////////////////////////////////////
+// Add a mesh of the model as a geometry in the scene of the model, sharing
+// the welded buffers with embree. The geomID of a mesh is its index in the
+// model, which is how getIntersection() finds it.
+///////////////////////////////////////////////////////////////////////////
+static void addMesh(ModelGeometry& geometry, uint32_t m)
+{
+	const labhelper::Mesh& mesh = geometry.model->m_meshes[m];
+	const size_t num_vertices = geometry.positions.size() - 1;
+	const RTCGeometryFlags flags = geometry.dynamic ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC;
+	uint32_t geom_ID = rtcNewTriangleMesh2(geometry.scene, flags, mesh.m_number_of_vertices / 3, num_vertices, 1, m);
+	rtcSetBuffer2(geometry.scene, geom_ID, RTC_INDEX_BUFFER, geometry.indices.data(),
+	              mesh.m_start_index * sizeof(uint32_t), 3 * sizeof(uint32_t), mesh.m_number_of_vertices / 3);
+	rtcSetBuffer2(geometry.scene, geom_ID, RTC_VERTEX_BUFFER, geometry.positions.data(), 0, sizeof(vec3),
+	              num_vertices);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Build the built-in BVH of a model over the same buffers, with the meshes
+// getting the same geomIDs as in embree.
+///////////////////////////////////////////////////////////////////////////
+static void buildModelBVH(ModelGeometry& geometry)
+{
+	vector<BVHMesh> meshes;
+	for(auto& mesh : geometry.model->m_meshes)
+	{
+		meshes.push_back({ geometry.indices.data() + mesh.m_start_index, mesh.m_number_of_vertices / 3 });
+	}
+	geometry.bvh.build(geometry.positions.data(), meshes, embree_threads);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// How loose a BVH over the current positions is: the summed bounding box
+// area of runs of consecutive triangles (which the builder tends to put
+// in the same subtree), relative to the area of the whole model. A refit
+// keeps the tree, so when this grows well above its value at the last
+// build, the tree no longer fits the geometry and should be rebuilt.
+///////////////////////////////////////////////////////////////////////////
+static const size_t CLUSTER_TRIANGLES = 32;
+
+static float boxArea(const vec3& lo, const vec3& hi)
+{
+	const vec3 d = max(hi - lo, vec3(0.0f));
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static float clusterArea(const ModelGeometry& geometry)
+{
+	vec3 model_lo(FLT_MAX), model_hi(-FLT_MAX);
+	double cluster_area = 0.0;
+	const size_t num_indices = geometry.indices.size();
+	for(size_t first = 0; first < num_indices; first += 3 * CLUSTER_TRIANGLES)
+	{
+		vec3 lo(FLT_MAX), hi(-FLT_MAX);
+		const size_t last = std::min(num_indices, first + 3 * CLUSTER_TRIANGLES);
+		for(size_t i = first; i < last; i++)
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			const vec3& p = geometry.positions[geometry.indices[i]];
+			lo = min(lo, p);
+			hi = max(hi, p);
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		cluster_area += boxArea(lo, hi);
+		model_lo = min(model_lo, lo);
+		model_hi = max(model_hi, hi);
+	}
+	const float model_area = boxArea(model_lo, model_hi);
+	return model_area > 0.0f ? float(cluster_area / model_area) : 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Create and build the scene of a model. With settings.dynamic_geometry
+// it is a dynamic scene of deformable meshes, that can be refit after the
+// vertices move. With the built-in backend, a BVH of the model instead.
+///////////////////////////////////////////////////////////////////////////
+static void buildModelScene(ModelGeometry& geometry)
+{
+	geometry.dynamic = settings.dynamic_geometry;
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		geometry.scene = newScene(geometry.dynamic);
+		for(uint32_t m = 0; m < geometry.model->m_meshes.size(); m++)
 		{
-			embree_tri_idxs[i] = i;
+			addMesh(geometry, m);
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
+		rtcCommit(geometry.scene);
+		geometry.bvh = BVH();
 	}
+#endif
+	if(!usingEmbree())
+		buildModelBVH(geometry);
+	geometry.built_quality = clusterArea(geometry);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// (Re)compile the materials of a model, and which mesh uses which
+///////////////////////////////////////////////////////////////////////////
+static void compileMaterials(ModelGeometry& geometry)
+{
+	const labhelper::Model* model = geometry.model;
+	for(size_t m = 0; m < model->m_materials.size(); m++)
+	{
+		material_table[geometry.first_material + m] = compileMaterial(model->m_materials[m]);
+	}
+	for(size_t m = 0; m < model->m_meshes.size(); m++)
+	{
+		const uint32_t material_idx = model->m_meshes[m].m_material_idx;
+		geometry.records[m].material = &model->m_materials[material_idx];
+		geometry.records[m].material_index = geometry.first_material + material_idx;
+	}
+}
+
+void updateMaterials()
+{
+	for(auto& geometry : model_geometries)
+	{
+		compileMaterials(*geometry);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add an instance of a model to the embree scene
+///////////////////////////////////////////////////////////////////////////
+uint32_t addModel(const labhelper::Model* model, const mat4& model_matrix)
+{
+	initializeEmbree();
+	cout << "Adding " << model->m_name << " to the scene..." << flush;
+	ModelGeometry* geometry = getModelGeometry(model);
+	uint32_t inst_ID = uint32_t(instances.size());
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+		inst_ID = rtcNewInstance2(embree_scene, geometry->scene);
+#endif
+	if(instances.size() <= inst_ID)
+		instances.resize(inst_ID + 1);
+	instances[inst_ID].geometry = geometry;
+	setInstanceTransform(inst_ID, model_matrix);
 	cout << "done.\n";
+	return inst_ID;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Move an instance. Takes effect at the next commitInstances().
+///////////////////////////////////////////////////////////////////////////
+void setInstanceTransform(uint32_t instance, const mat4& model_matrix)
+{
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		rtcSetTransform2(embree_scene, instance, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0].x);
+		rtcUpdate(embree_scene, instance);
+	}
+#endif
+	instances[instance].transform = model_matrix;
+	instances[instance].normal_matrix = inverseTranspose(mat3(model_matrix));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Rebuild the top level of the scene. The scenes of the models are left
+// as they are.
+///////////////////////////////////////////////////////////////////////////
+void commitInstances()
+{
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+		rtcCommit(embree_scene);
+#endif
+	if(!usingEmbree())
+		buildInstanceBVH();
+	scene_version++;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Extract an intersection from an embree ray.
+// Move the vertices of a model to where model->m_positions says they are.
+// The BVH of the model is refit if it still fits the geometry well enough
+// (see clusterArea()), and rebuilt otherwise.
+///////////////////////////////////////////////////////////////////////////
+void updateModelVertices(const labhelper::Model* model)
+{
+	ModelGeometry* geometry = nullptr;
+	for(auto& g : model_geometries)
+	{
+		if(g->model == model)
+			geometry = g.get();
+	}
+	if(geometry == nullptr)
+		return;
+	if(!geometry->dynamic)
+	{
+		cout << "updateModelVertices: " << model->m_name << " was not added with dynamic geometry\n";
+		return;
+	}
+	const double start = omp_get_wtime();
+	for(size_t i = 0; i < model->m_positions.size(); i++)
+	{
+		geometry->positions[geometry->indices[i]] = model->m_positions[i];
+	}
+	const float quality = clusterArea(*geometry) / geometry->built_quality;
+	const bool refit = quality <= settings.rebuild_threshold;
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		for(uint32_t m = 0; m < model->m_meshes.size(); m++)
+		{
+			if(refit)
+			{
+				rtcUpdateBuffer(geometry->scene, m, RTC_VERTEX_BUFFER);
+			}
+			else
+			{
+				// A new geometry gets a BVH built from scratch
+				rtcDeleteGeometry(geometry->scene, m);
+				addMesh(*geometry, m);
+			}
+		}
+		rtcCommit(geometry->scene);
+		for(uint32_t i = 0; i < instances.size(); i++)
+		{
+			if(instances[i].geometry == geometry)
+				rtcUpdate(embree_scene, i);
+		}
+		rtcCommit(embree_scene);
+	}
+#endif
+	if(!usingEmbree())
+	{
+		if(refit)
+			geometry->bvh.refit();
+		else
+			buildModelBVH(*geometry);
+		// The boxes of the instances have changed
+		buildInstanceBVH();
+	}
+	if(!refit)
+		geometry->built_quality = clusterArea(*geometry);
+	scene_version++;
+	commit_stats.time = omp_get_wtime() - start;
+	commit_stats.refit = refit;
+	commit_stats.quality = quality;
+	commit_stats.memory = bvhMemory();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build all of the scene again, e.g. after settings.dynamic_geometry, the
+// backend or the embree settings have changed. Instances keep their ids.
+// The embree device is only recreated if the number of threads changed.
+///////////////////////////////////////////////////////////////////////////
+void rebuildScene()
+{
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		rtcDeleteScene(embree_scene);
+		for(auto& geometry : model_geometries)
+		{
+			rtcDeleteScene(geometry->scene);
+		}
+	}
+	if(settings.embree_threads != embree_threads)
+	{
+		rtcDeleteDevice(embree_device);
+		embree_threads = settings.embree_threads;
+		createDevice();
+	}
+#endif
+	applySceneSettings();
+	const double start = omp_get_wtime();
+	for(auto& geometry : model_geometries)
+	{
+		buildModelScene(*geometry);
+	}
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		embree_scene = newScene(true);
+		for(uint32_t i = 0; i < instances.size(); i++)
+		{
+			if(instances[i].geometry == nullptr)
+				continue;
+			rtcNewInstance3(embree_scene, instances[i].geometry->scene, 1, i);
+			setInstanceTransform(i, instances[i].transform);
+		}
+		rtcCommit(embree_scene);
+		instance_bvh = InstanceBVH();
+	}
+#endif
+	if(!usingEmbree())
+		buildInstanceBVH();
+	scene_version++;
+	commit_stats.time = omp_get_wtime() - start;
+	commit_stats.refit = false;
+	commit_stats.quality = 1.0f;
+	commit_stats.memory = bvhMemory();
+}
+
+const CommitStats& getCommitStats()
+{
+	return commit_stats;
+}
+
+uint32_t getSceneVersion()
+{
+	return scene_version;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Extract an intersection from an embree ray. Embree reports the normal
+// of an instanced hit in the space of the model.
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
-	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
-	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
+	const Instance& instance = instances[r.instID];
+	const GeometryRecord& record = instance.geometry->records[r.geomID];
 	Intersection i;
-	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	i.material = record.material;
+	i.material_index = record.material_index;
+	const vec3* n = record.normals + r.primID * 3;
 	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-	i.geometry_normal = -normalize(r.n);
+	i.shading_normal = normalize(instance.normal_matrix * (w * n[0] + r.u * n[1] + r.v * n[2]));
+	if(record.texture_coordinates != nullptr)
+	{
+		const vec2* uv = record.texture_coordinates + r.primID * 3;
+		i.texture_coordinates = w * uv[0] + r.u * uv[1] + r.v * uv[2];
+	}
+	else
+	{
+		i.texture_coordinates = vec2(0.0f);
+	}
+	i.geometry_normal = -normalize(instance.normal_matrix * r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
 	return i;
@@ -113,8 +669,14 @@ Intersection getIntersection(const Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool intersect(Ray& r)
 {
-	rtcIntersect(embree_scene, *((RTCRay*)&r));
-	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		rtcIntersect(embree_scene, *((RTCRay*)&r));
+		return r.geomID != RTC_INVALID_GEOMETRY_ID;
+	}
+#endif
+	return instance_bvh.intersect(r);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -123,7 +685,166 @@ bool intersect(Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r)
 {
-	rtcOccluded(embree_scene, *((RTCRay*)&r));
-	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+#ifdef PATHTRACER_EMBREE
+	if(usingEmbree())
+	{
+		rtcOccluded(embree_scene, *((RTCRay*)&r));
+		return r.geomID != RTC_INVALID_GEOMETRY_ID;
+	}
+#endif
+	// Like embree, mark an occluded ray with geomID 0
+	if(instance_bvh.occluded(r))
+	{
+		r.geomID = 0;
+		return true;
+	}
+	return false;
+}
+
+#ifdef PATHTRACER_EMBREE
+///////////////////////////////////////////////////////////////////////////
+// Copy up to eight rays into an embree ray packet, and back again.
+///////////////////////////////////////////////////////////////////////////
+static void toPacket(const Ray* rays, int count, RTCRay8& packet, int* valid)
+{
+	for(int i = 0; i < 8; i++)
+	{
+		const Ray& r = rays[std::min(i, count - 1)];
+		valid[i] = i < count ? -1 : 0;
+		packet.orgx[i] = r.o.x;
+		packet.orgy[i] = r.o.y;
+		packet.orgz[i] = r.o.z;
+		packet.dirx[i] = r.d.x;
+		packet.diry[i] = r.d.y;
+		packet.dirz[i] = r.d.z;
+		packet.tnear[i] = r.tnear;
+		packet.tfar[i] = r.tfar;
+		packet.time[i] = r.time;
+		packet.mask[i] = r.mask;
+		packet.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+		packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+		packet.instID[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+}
+
+static void fromPacket(const RTCRay8& packet, Ray* rays, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		Ray& r = rays[i];
+		r.tfar = packet.tfar[i];
+		r.n = vec3(packet.Ngx[i], packet.Ngy[i], packet.Ngz[i]);
+		r.u = packet.u[i];
+		r.v = packet.v[i];
+		r.geomID = packet.geomID[i];
+		r.primID = packet.primID[i];
+		r.instID = packet.instID[i];
+	}
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Find the closest intersection for every ray in an array
+///////////////////////////////////////////////////////////////////////////
+void intersect(Ray* rays, size_t count, bool coherent)
+{
+	if(count == 0)
+		return;
+	if(!usingEmbree())
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			instance_bvh.intersect(rays[i]);
+		}
+		return;
+	}
+#ifdef PATHTRACER_EMBREE
+	RTCIntersectContext context;
+	context.userRayExt = nullptr;
+	if(coherent && (embree_algorithm_flags & RTC_INTERSECT8))
+	{
+		context.flags = RTC_INTERSECT_COHERENT;
+		RTCRay8 packet;
+		RTCORE_ALIGN(32) int valid[8];
+		for(size_t i = 0; i < count; i += 8)
+		{
+			const int packet_size = int(std::min(size_t(8), count - i));
+			toPacket(&rays[i], packet_size, packet, valid);
+			rtcIntersect8Ex(valid, embree_scene, &context, packet);
+			fromPacket(packet, &rays[i], packet_size);
+		}
+	}
+	else if(embree_algorithm_flags & RTC_INTERSECT_STREAM)
+	{
+		context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+		rtcIntersect1M(embree_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+	}
+	else
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			intersect(rays[i]);
+		}
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test every ray in an array for occlusion
+///////////////////////////////////////////////////////////////////////////
+void occluded(Ray* rays, size_t count, bool coherent)
+{
+	if(count == 0)
+		return;
+	if(!usingEmbree())
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			occluded(rays[i]);
+		}
+		return;
+	}
+#ifdef PATHTRACER_EMBREE
+	RTCIntersectContext context;
+	context.userRayExt = nullptr;
+	if(coherent && (embree_algorithm_flags & RTC_INTERSECT8))
+	{
+		context.flags = RTC_INTERSECT_COHERENT;
+		RTCRay8 packet;
+		RTCORE_ALIGN(32) int valid[8];
+		for(size_t i = 0; i < count; i += 8)
+		{
+			const int packet_size = int(std::min(size_t(8), count - i));
+			toPacket(&rays[i], packet_size, packet, valid);
+			rtcOccluded8Ex(valid, embree_scene, &context, packet);
+			for(int j = 0; j < packet_size; j++)
+			{
+				rays[i + j].geomID = packet.geomID[j];
+			}
+		}
+	}
+	else if(embree_algorithm_flags & RTC_INTERSECT_STREAM)
+	{
+		context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+		rtcOccluded1M(embree_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+	}
+	else
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			occluded(rays[i]);
+		}
+	}
+#endif
+}
+
+void intersect(RayBatch& batch)
+{
+	intersect(batch.rays.data(), batch.size(), batch.coherent);
+}
+
+void occluded(RayBatch& batch)
+{
+	occluded(batch.rays.data(), batch.size(), batch.coherent);
 }
-} // namespace pathtracer
\ No newline at end of file
+} // namespace pathtracer
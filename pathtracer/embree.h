@@ -1,22 +1,88 @@
 #pragma once
+#ifdef PATHTRACER_EMBREE
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
+#else
+// Without embree only the built-in BVH (bvh.h) is available, which uses
+// the same rays
+#define RTCORE_ALIGN(...) alignas(__VA_ARGS__)
+#define RTC_INVALID_GEOMETRY_ID ((unsigned)-1)
+#endif
+#include <cfloat>
+#include <cstdint>
 #include "Model.h"
 #include <glm/glm.hpp>
-#include <map>
+#include <vector>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// What traces the rays: embree, or the BVH of the pathtracer (bvh.h).
+// Embree is only available when built with PATHTRACER_EMBREE.
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+enum BVHBackend
+{
+	BVH_BACKEND_EMBREE = 0,
+	BVH_BACKEND_NATIVE,
+	BVH_BACKEND_COUNT
+};
+bool isBackendAvailable(BVHBackend backend);
+
+///////////////////////////////////////////////////////////////////////////
+// Add an instance of a model to the embree scene, and return its id. A
+// model that is added several times is only stored and built once.
+///////////////////////////////////////////////////////////////////////////
+uint32_t addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+
+///////////////////////////////////////////////////////////////////////////
+// Move an instance of a model. Call commitInstances() when all instances
+// have been moved, which only rebuilds the top level of the BVH.
+///////////////////////////////////////////////////////////////////////////
+void setInstanceTransform(uint32_t instance, const glm::mat4& model_matrix);
+void commitInstances();
+
+///////////////////////////////////////////////////////////////////////////
+// Animated geometry (needs settings.dynamic_geometry when the model was
+// added). After changing model->m_positions, updateModelVertices() refits
+// or rebuilds the BVH of the model, whichever settings.rebuild_threshold
+// says. Vertices that share a position must keep sharing it.
+///////////////////////////////////////////////////////////////////////////
+void updateModelVertices(const labhelper::Model* model);
+
+///////////////////////////////////////////////////////////////////////////
+// Build the whole scene again, with the current settings (including the
+// backend, the embree scene flags, algorithm flags and number of threads)
+///////////////////////////////////////////////////////////////////////////
+void rebuildScene();
+
+///////////////////////////////////////////////////////////////////////////
+// What the last commit of the scene cost
+///////////////////////////////////////////////////////////////////////////
+struct CommitStats
+{
+	double time = 0.0;    // Seconds
+	bool refit = false;   // Refit instead of rebuilt
+	float quality = 1.0f; // How loose the refit BVH is, 1 = as built
+	int64_t memory = 0;   // Bytes allocated for BVHs afterwards
+};
+const CommitStats& getCommitStats();
+
+///////////////////////////////////////////////////////////////////////////
+// Changes every time the geometry does (with each BVH build, rebuild,
+// refit or instance commit)
+///////////////////////////////////////////////////////////////////////////
+uint32_t getSceneVersion();
 
 ///////////////////////////////////////////////////////////////////////////
 // Build an acceleration structure for the scene
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH();
 
+///////////////////////////////////////////////////////////////////////////
+// Recompile the materials of all models, after they have been edited
+///////////////////////////////////////////////////////////////////////////
+void updateMaterials();
+
 ///////////////////////////////////////////////////////////////////////////
 // This struct is what an embree Ray must look like. It contains the
 // information about the ray to be shot and (after intersect() has been
@@ -60,7 +126,9 @@ struct Intersection
 	glm::vec3 geometry_normal;
 	glm::vec3 shading_normal;
 	glm::vec3 wo;
+	glm::vec2 texture_coordinates;
 	const labhelper::Material* material;
+	uint32_t material_index; // Into material_table
 };
 Intersection getIntersection(const Ray& r);
 
@@ -74,4 +142,50 @@ bool intersect(Ray& r);
 // intersection).
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r);
-} // namespace pathtracer
\ No newline at end of file
+
+///////////////////////////////////////////////////////////////////////////
+// A batch of rays that are traced together. Coherent batches (e.g. the
+// primary rays of one tile) are traced as packets of 8 rays, other
+// batches are handed to embree as a ray stream. The built-in BVH traces
+// them one at a time.
+///////////////////////////////////////////////////////////////////////////
+struct RayBatch
+{
+	std::vector<Ray> rays;
+	bool coherent = false;
+	void clear()
+	{
+		rays.clear();
+	}
+	void add(const Ray& r)
+	{
+		rays.push_back(r);
+	}
+	size_t size() const
+	{
+		return rays.size();
+	}
+	Ray& operator[](size_t i)
+	{
+		return rays[i];
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Find the closest intersection for every ray in the batch. A ray hit
+// something if its geomID is valid afterwards.
+///////////////////////////////////////////////////////////////////////////
+void intersect(RayBatch& batch);
+
+///////////////////////////////////////////////////////////////////////////
+// Test every ray in the batch for occlusion. Afterwards a ray is occluded
+// if its geomID is valid.
+///////////////////////////////////////////////////////////////////////////
+void occluded(RayBatch& batch);
+
+///////////////////////////////////////////////////////////////////////////
+// Same as above, for a range of rays (e.g. one thread's share of a batch)
+///////////////////////////////////////////////////////////////////////////
+void intersect(Ray* rays, size_t count, bool coherent);
+void occluded(Ray* rays, size_t count, bool coherent);
+} // namespace pathtracer
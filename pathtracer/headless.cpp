@@ -0,0 +1,381 @@
+///////////////////////////////////////////////////////////////////////////////
+// The pathtracer without a window or GL context, for batch rendering on
+// machines without a display. Renders one image with the given settings,
+// writes it to a file and prints what it took as JSON on stdout.
+//
+//	pathtracer-headless [options]
+//
+// See printUsage() for the options. Everything the pathtracer and the
+// model loader print goes to stderr, so stdout is only the JSON.
+///////////////////////////////////////////////////////////////////////////////
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "denoiser.h"
+#include "ImageFile.h"
+#include "statistics.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// What to render, from the command line. The defaults are the scene of
+// the interactive pathtracer.
+///////////////////////////////////////////////////////////////////////////////
+struct ModelArgument
+{
+	string filename;
+	vec3 translation;
+};
+
+struct Options
+{
+	vector<ModelArgument> models;
+	string envmap = "../scenes/envmaps/001.hdr";
+	float environment_multiplier = 1.0f;
+	vec3 light_position = vec3(10.0f, 40.0f, 10.0f);
+	float light_intensity = 2500.0f;
+	vec3 camera_position = vec3(-30.0f, 10.0f, 30.0f);
+	vec3 camera_target = vec3(0.0f, 10.0f, 0.0f);
+	float fov = 45.0f;
+	int width = 1280, height = 720;
+	int spp = 16;
+	int bounces = 8;
+	double time_budget = 0.0; // Seconds of rendering, 0 = no limit
+	pathtracer::Integrator integrator = pathtracer::INTEGRATOR_PATH;
+	pathtracer::BVHBackend backend = pathtracer::BVH_BACKEND_NATIVE;
+	int threads = 0;
+	bool denoise = false;
+	string output = "pathtracer.hdr";
+	string statistics; // CSV file with the statistics of every pass, if not empty
+};
+
+static void printUsage()
+{
+	cerr << "Usage: pathtracer-headless [options]\n"
+	        "  --model FILE[@X,Y,Z]   Add an OBJ model, translated by X,Y,Z (repeatable,\n"
+	        "                         default: the ship on the landing pad)\n"
+	        "  --envmap FILE          Environment map (.hdr)\n"
+	        "  --env-multiplier F     Scale of the environment map\n"
+	        "  --light X,Y,Z          Position of the point light\n"
+	        "  --light-intensity F    Intensity of the point light\n"
+	        "  --camera X,Y,Z         Camera position\n"
+	        "  --target X,Y,Z         Point the camera looks at\n"
+	        "  --fov DEGREES          Vertical field of view\n"
+	        "  --size WxH             Resolution\n"
+	        "  --spp N                Samples per pixel (0 = until the time budget runs out)\n"
+	        "  --bounces N            Maximum number of bounces\n"
+	        "  --time SECONDS         Stop rendering before this much time has passed\n"
+	        "  --integrator NAME      path or wavefront\n"
+	        "  --backend NAME         native or embree\n"
+	        "  --threads N            Rendering and BVH build threads (0 = all)\n"
+	        "  --denoise              Denoise the image before writing it\n"
+	        "  --output FILE          .pfm, .hdr or .png\n"
+	        "  --statistics FILE      Write the statistics of every pass to a CSV file\n";
+}
+
+static bool parseVec3(const char* text, vec3& v)
+{
+	return sscanf(text, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill in the options from the command line. Prints what is wrong and
+// returns false if the command line does not make sense.
+///////////////////////////////////////////////////////////////////////////////
+static bool parseArguments(int argc, char* argv[], Options& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		const string option = argv[i];
+		if(option == "--help" || option == "-h")
+		{
+			return false;
+		}
+		if(option == "--denoise")
+		{
+			options.denoise = true;
+			continue;
+		}
+		if(i + 1 >= argc)
+		{
+			cerr << "ERROR: " << option << " needs a value\n";
+			return false;
+		}
+		const char* value = argv[++i];
+		bool ok = true;
+		if(option == "--model")
+		{
+			ModelArgument model;
+			model.filename = value;
+			model.translation = vec3(0.0f);
+			const size_t at = model.filename.find_last_of('@');
+			if(at != string::npos)
+			{
+				ok = parseVec3(model.filename.c_str() + at + 1, model.translation);
+				model.filename.resize(at);
+			}
+			options.models.push_back(model);
+		}
+		else if(option == "--envmap")
+			options.envmap = value;
+		else if(option == "--env-multiplier")
+			options.environment_multiplier = float(atof(value));
+		else if(option == "--light")
+			ok = parseVec3(value, options.light_position);
+		else if(option == "--light-intensity")
+			options.light_intensity = float(atof(value));
+		else if(option == "--camera")
+			ok = parseVec3(value, options.camera_position);
+		else if(option == "--target")
+			ok = parseVec3(value, options.camera_target);
+		else if(option == "--fov")
+			options.fov = float(atof(value));
+		else if(option == "--size")
+			ok = sscanf(value, "%dx%d", &options.width, &options.height) == 2 && options.width > 0
+			     && options.height > 0;
+		else if(option == "--spp")
+			options.spp = atoi(value);
+		else if(option == "--bounces")
+			options.bounces = atoi(value);
+		else if(option == "--time")
+			options.time_budget = atof(value);
+		else if(option == "--integrator")
+		{
+			ok = strcmp(value, "path") == 0 || strcmp(value, "wavefront") == 0;
+			options.integrator =
+			    strcmp(value, "wavefront") == 0 ? pathtracer::INTEGRATOR_WAVEFRONT : pathtracer::INTEGRATOR_PATH;
+		}
+		else if(option == "--backend")
+		{
+			ok = strcmp(value, "native") == 0 || strcmp(value, "embree") == 0;
+			options.backend = strcmp(value, "embree") == 0 ? pathtracer::BVH_BACKEND_EMBREE :
+			                                                  pathtracer::BVH_BACKEND_NATIVE;
+			if(ok && !pathtracer::isBackendAvailable(options.backend))
+			{
+				cerr << "ERROR: built without embree\n";
+				return false;
+			}
+		}
+		else if(option == "--threads")
+			options.threads = atoi(value);
+		else if(option == "--output")
+			options.output = value;
+		else if(option == "--statistics")
+			options.statistics = value;
+		else
+		{
+			cerr << "ERROR: unknown option " << option << "\n";
+			return false;
+		}
+		if(!ok)
+		{
+			cerr << "ERROR: bad value for " << option << ": " << value << "\n";
+			return false;
+		}
+	}
+	if(options.spp <= 0 && options.time_budget <= 0.0)
+	{
+		cerr << "ERROR: give --spp or --time, or rendering never ends\n";
+		return false;
+	}
+	if(options.models.empty())
+	{
+		options.models.push_back({ "../scenes/NewShip.obj", vec3(0.0f, 10.0f, 0.0f) });
+		options.models.push_back({ "../scenes/landingpad2.obj", vec3(0.0f) });
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A string as a JSON string literal (file names may hold backslashes)
+///////////////////////////////////////////////////////////////////////////////
+static string jsonString(const string& text)
+{
+	string quoted = "\"";
+	for(char c : text)
+	{
+		if(c == '"' || c == '\\')
+			quoted += '\\';
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+
+int main(int argc, char* argv[])
+{
+	// Keep stdout for the JSON, and send everything else to stderr
+	ostream json(cout.rdbuf());
+	cout.rdbuf(cerr.rdbuf());
+
+	Options options;
+	if(!parseArguments(argc, argv, options))
+	{
+		printUsage();
+		return 1;
+	}
+	const double start = omp_get_wtime();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Path-tracer settings, as in the interactive pathtracer except for
+	// what comes from the command line
+	///////////////////////////////////////////////////////////////////////////
+	if(options.threads > 0)
+		omp_set_num_threads(options.threads);
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.tile_order = pathtracer::TILE_ORDER_MORTON;
+	pathtracer::settings.use_ray_packets = true;
+	pathtracer::settings.integrator = options.integrator;
+	pathtracer::settings.antialiasing = true;
+	pathtracer::settings.lens_radius = 0.0f;
+	pathtracer::settings.focal_distance = 30.0f;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.adaptive_threshold = 0.02f;
+	pathtracer::settings.sampler = pathtracer::SAMPLER_SOBOL;
+	pathtracer::settings.dynamic_geometry = false;
+	pathtracer::settings.rebuild_threshold = 1.5f;
+	pathtracer::settings.bvh_backend = options.backend;
+	pathtracer::settings.embree_scene_flags = 0;
+#ifdef PATHTRACER_EMBREE
+	pathtracer::settings.embree_algorithm_flags = RTC_INTERSECT1 | RTC_INTERSECT8 | RTC_INTERSECT_STREAM;
+#else
+	pathtracer::settings.embree_algorithm_flags = 0;
+#endif
+	pathtracer::settings.embree_threads = options.threads;
+	pathtracer::settings.denoise = options.denoise;
+	pathtracer::settings.denoise_iterations = 3;
+	pathtracer::settings.reprojection = false;
+	pathtracer::settings.max_history = 64;
+	pathtracer::settings.progressive = false;
+	pathtracer::settings.target_pass_time = 33.0f;
+	pathtracer::settings.primary_cache_samples = 0;
+
+	pathtracer::point_light.intensity_multiplier = options.light_intensity;
+	pathtracer::point_light.color = vec3(1.0f, 1.0f, 1.0f);
+	pathtracer::point_light.position = options.light_position;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load the scene and build the BVH
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::environment.map.load(options.envmap);
+	pathtracer::environment.multiplier = options.environment_multiplier;
+	vector<labhelper::Model*> models;
+	for(auto& m : options.models)
+	{
+		models.push_back(labhelper::loadModelFromOBJ(m.filename));
+	}
+	const double load_time = omp_get_wtime() - start;
+
+	const double build_start = omp_get_wtime();
+	for(size_t i = 0; i < models.size(); i++)
+	{
+		pathtracer::addModel(models[i], translate(options.models[i].translation));
+	}
+	pathtracer::buildBVH();
+	const double build_time = omp_get_wtime() - build_start;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render passes of one sample per pixel, until we have enough or the
+	// next pass would not fit in the time budget
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::resize(options.width, options.height);
+	const mat4 V = lookAt(options.camera_position, options.camera_target, vec3(0.0f, 1.0f, 0.0f));
+	const mat4 P = perspective(radians(options.fov), float(options.width) / float(options.height), 0.1f, 100.0f);
+	vector<double> pass_times;
+	if(!options.statistics.empty() && !pathtracer::openStatisticsFile(options.statistics))
+		return 1;
+	const double render_start = omp_get_wtime();
+	double render_time = 0.0;
+	while(options.spp <= 0 || int(pass_times.size()) < options.spp)
+	{
+		if(options.time_budget > 0.0 && !pass_times.empty()
+		   && render_time + pass_times.back() > options.time_budget)
+			break;
+		const double pass_start = omp_get_wtime();
+		pathtracer::tracePaths(V, P);
+		pass_times.push_back(omp_get_wtime() - pass_start);
+		render_time = omp_get_wtime() - render_start;
+	}
+	pathtracer::closeStatisticsFile();
+	const pathtracer::PassStatistics& totals = pathtracer::statistics.total;
+	const uint64_t rays = totals.rays();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write the image
+	///////////////////////////////////////////////////////////////////////////
+	double denoise_time = 0.0;
+	vector<vec3> image;
+	if(options.denoise)
+	{
+		const double denoise_start = omp_get_wtime();
+		pathtracer::denoise(image);
+		denoise_time = omp_get_wtime() - denoise_start;
+	}
+	else
+	{
+		image = pathtracer::rendered_image.data;
+	}
+	const bool written = pathtracer::writeImage(options.output, image, options.width, options.height);
+	if(!written)
+		cerr << "ERROR: could not write " << options.output << "\n";
+	const double total_time = omp_get_wtime() - start;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Report, as one JSON object
+	///////////////////////////////////////////////////////////////////////////
+	json.precision(6);
+	json << "{\n";
+	json << "  \"output\": " << jsonString(options.output) << ",\n";
+	json << "  \"written\": " << (written ? "true" : "false") << ",\n";
+	json << "  \"width\": " << options.width << ",\n";
+	json << "  \"height\": " << options.height << ",\n";
+	json << "  \"spp\": " << pass_times.size() << ",\n";
+	json << "  \"bounces\": " << options.bounces << ",\n";
+	json << "  \"integrator\": \""
+	     << (options.integrator == pathtracer::INTEGRATOR_WAVEFRONT ? "wavefront" : "path") << "\",\n";
+	json << "  \"backend\": \"" << (options.backend == pathtracer::BVH_BACKEND_EMBREE ? "embree" : "native")
+	     << "\",\n";
+	json << "  \"threads\": " << omp_get_max_threads() << ",\n";
+	json << "  \"load_seconds\": " << load_time << ",\n";
+	json << "  \"build_seconds\": " << build_time << ",\n";
+	json << "  \"bvh_bytes\": " << pathtracer::getCommitStats().memory << ",\n";
+	json << "  \"pass_seconds\": [";
+	for(size_t i = 0; i < pass_times.size(); i++)
+	{
+		json << (i > 0 ? ", " : "") << pass_times[i];
+	}
+	json << "],\n";
+	json << "  \"render_seconds\": " << render_time << ",\n";
+	json << "  \"denoise_seconds\": " << denoise_time << ",\n";
+	json << "  \"rays\": " << rays << ",\n";
+	for(int c = 0; c < pathtracer::COUNTER_COUNT; c++)
+	{
+		json << "  \"" << pathtracer::counterName(pathtracer::Counter(c)) << "\": " << totals.counters[c] << ",\n";
+	}
+	json << "  \"path_lengths\": [";
+	for(int l = 0; l <= pathtracer::MAX_PATH_LENGTH; l++)
+	{
+		json << (l > 0 ? ", " : "") << totals.path_lengths[l];
+	}
+	json << "],\n";
+	json << "  \"mrays_per_second\": " << (render_time > 0.0 ? rays / render_time / 1e6 : 0.0) << ",\n";
+	json << "  \"total_seconds\": " << total_time << "\n";
+	json << "}\n";
+
+	for(auto m : models)
+	{
+		labhelper::freeModel(m);
+	}
+	return written ? 0 : 1;
+}
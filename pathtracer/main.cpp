@@ -12,6 +12,11 @@
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
+#include "denoiser.h"
+#include "reprojection.h"
+#include "statistics.h"
+#include "ImageUploader.h"
+#include "RenderThread.h"
 
 using namespace glm;
 using namespace std;
@@ -29,15 +34,30 @@ static float deltaTime = 0.0f;
 ivec2 g_prevMouseCoords = { -1, -1 };
 bool g_isMouseDragging = false;
 
+// Show how many samples each pixel got instead of the image
+bool showSampleHeatmap = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// Renders passes while the UI runs. frame is the one shown, pauseTime how
+// long the last pause (to change the scene) took to stop the renderer.
+///////////////////////////////////////////////////////////////////////////////
+pathtracer::RenderThread renderThread;
+const pathtracer::Frame* frame = nullptr;
+double pauseTime = 0.0;
+// How long the last reprojection took, and how many pixels kept samples
+double reprojectionTime = 0.0;
+float reprojectionKept = 0.0f;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
 ///////////////////////////////////////////////////////////////////////////////
 GLuint shaderProgram;
 
 ///////////////////////////////////////////////////////////////////////////////
-// GL texture to put pathtracing result into
+// Tonemaps the pathtracing result into a GL texture for display
 ///////////////////////////////////////////////////////////////////////////////
-uint32_t pathtracer_result_txt_id;
+pathtracer::ImageUploader imageUploader;
+pathtracer::ToneMapping toneMapping;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -50,6 +70,22 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 // Models
 ///////////////////////////////////////////////////////////////////////////////
 vector<pair<labhelper::Model*, mat4>> models;
+// The pathtracer instance of each model
+vector<uint32_t> modelInstances;
+// Spin the ship (the first model) around its own up axis
+bool animateShip = false;
+float shipAngle = 0.0f;
+// Make the ship wobble by moving its vertices
+bool deformShip = false;
+vector<vec3> shipRestPositions;
+
+// Rebuild the BVH with the current settings at the next frame (or once
+// with every backend, to compare them), and what each rebuild cost and
+// bought
+bool rebuildBVH = false;
+bool compareBackends = false;
+vector<string> bvhResults;
+const char* backendNames[] = { "Embree", "Native" };
 
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
@@ -66,6 +102,35 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.tile_order = pathtracer::TILE_ORDER_MORTON;
+	pathtracer::settings.use_ray_packets = true;
+	pathtracer::settings.integrator = pathtracer::INTEGRATOR_PATH;
+	pathtracer::settings.antialiasing = true;
+	pathtracer::settings.lens_radius = 0.0f;
+	pathtracer::settings.focal_distance = 30.0f;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.adaptive_threshold = 0.02f;
+	pathtracer::settings.sampler = pathtracer::SAMPLER_SOBOL;
+	pathtracer::settings.dynamic_geometry = false;
+	pathtracer::settings.rebuild_threshold = 1.5f;
+	pathtracer::settings.bvh_backend = pathtracer::isBackendAvailable(pathtracer::BVH_BACKEND_EMBREE) ?
+	                                       pathtracer::BVH_BACKEND_EMBREE :
+	                                       pathtracer::BVH_BACKEND_NATIVE;
+	pathtracer::settings.embree_scene_flags = 0;
+#ifdef PATHTRACER_EMBREE
+	pathtracer::settings.embree_algorithm_flags = RTC_INTERSECT1 | RTC_INTERSECT8 | RTC_INTERSECT_STREAM;
+#else
+	pathtracer::settings.embree_algorithm_flags = 0;
+#endif
+	pathtracer::settings.embree_threads = 0;
+	pathtracer::settings.denoise = false;
+	pathtracer::settings.denoise_iterations = 3;
+	pathtracer::settings.reprojection = false;
+	pathtracer::settings.max_history = 64;
+	pathtracer::settings.progressive = true;
+	pathtracer::settings.target_pass_time = 33.0f;
+	pathtracer::settings.primary_cache_samples = 4;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
@@ -99,61 +164,170 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	for(auto m : models)
 	{
-		pathtracer::addModel(m.first, m.second);
+		modelInstances.push_back(pathtracer::addModel(m.first, m.second));
 	}
 	pathtracer::buildBVH();
 
 	///////////////////////////////////////////////////////////////////////////
-	// Generate result texture
+	// Generate result texture. The image is sRGB encoded when it is
+	// tonemapped, so the framebuffer must not do it again.
 	///////////////////////////////////////////////////////////////////////////
-	glGenTextures(1, &pathtracer_result_txt_id);
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	///////////////////////////////////////////////////////////////////////////
-	// This is INCORRECT! But an easy way to get us a brighter image that
-	// just looks a little better...
-	///////////////////////////////////////////////////////////////////////////
-	//glEnable(GL_FRAMEBUFFER_SRGB);
+	imageUploader.init();
 }
 
 void display(void)
 {
-	{ ///////////////////////////////////////////////////////////////////////
-		// If first frame, or window resized, or subsampling changes,
-		// inform the pathtracer
-		///////////////////////////////////////////////////////////////////////
-		int w, h;
-		SDL_GetWindowSize(g_window, &w, &h);
-		static int old_subsampling;
-		if(windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling)
+	///////////////////////////////////////////////////////////////////////////
+	// If first frame, or window resized, or subsampling changes, or the
+	// camera moved, inform the pathtracer
+	///////////////////////////////////////////////////////////////////////////
+	int w, h;
+	SDL_GetWindowSize(g_window, &w, &h);
+	static int old_subsampling;
+	const bool resized =
+	    windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling;
+	const int subsampling = pathtracer::settings.subsampling;
+	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
+	mat4 projMatrix =
+	    perspective(radians(45.0f), float(w / subsampling) / float(h / subsampling), 0.1f, 100.0f);
+	static mat4 oldViewMatrix, oldProjMatrix;
+	const bool cameraMoved = viewMatrix != oldViewMatrix || projMatrix != oldProjMatrix;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Anything that changes the scene happens while the render thread is
+	// paused. In most frames nothing changes, and it just renders on.
+	///////////////////////////////////////////////////////////////////////////
+	if(resized || cameraMoved || animateShip || deformShip || rebuildBVH || compareBackends)
+	{
+		pauseTime = renderThread.pause();
+		if(resized)
 		{
 			pathtracer::resize(w, h);
 			windowWidth = w;
-			windowWidth = h;
+			windowHeight = h;
 			old_subsampling = pathtracer::settings.subsampling;
 		}
-	}
+		if(cameraMoved)
+		{
+			renderThread.setCamera(viewMatrix, projMatrix);
+			if(pathtracer::settings.reprojection && !resized)
+			{
+				const double start = omp_get_wtime();
+				reprojectionKept = pathtracer::reproject(oldViewMatrix, oldProjMatrix, viewMatrix, projMatrix);
+				reprojectionTime = omp_get_wtime() - start;
+			}
+			else
+			{
+				pathtracer::restart();
+			}
+			oldViewMatrix = viewMatrix;
+			oldProjMatrix = projMatrix;
+		}
 
-	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
-	///////////////////////////////////////////////////////////////////////////
-	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
-	mat4 projMatrix = perspective(radians(45.0f),
-	                              float(pathtracer::rendered_image.width)
-	                                  / float(pathtracer::rendered_image.height),
-	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+		///////////////////////////////////////////////////////////////////////
+		// Move the ship. Only the top level of the BVH needs to be rebuilt.
+		///////////////////////////////////////////////////////////////////////
+		if(animateShip)
+		{
+			shipAngle += deltaTime;
+			pathtracer::setInstanceTransform(modelInstances[0],
+			                                 models[0].second * rotate(shipAngle, worldUp));
+			pathtracer::commitInstances();
+			pathtracer::restart();
+		}
+		if(deformShip)
+		{
+			labhelper::Model* ship = models[0].first;
+			if(shipRestPositions.empty())
+			{
+				shipRestPositions = ship->m_positions;
+			}
+			for(size_t i = 0; i < ship->m_positions.size(); i++)
+			{
+				vec3 p = shipRestPositions[i];
+				p.y += 0.5f * sin(3.0f * currentTime + 0.5f * p.x);
+				ship->m_positions[i] = p;
+			}
+			pathtracer::updateModelVertices(ship);
+			pathtracer::restart();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Rebuild the BVH if asked to, and measure what we got
+		///////////////////////////////////////////////////////////////////////
+		if(rebuildBVH || compareBackends)
+		{
+			const pathtracer::BVHBackend selected = pathtracer::settings.bvh_backend;
+			for(int b = 0; b < pathtracer::BVH_BACKEND_COUNT; b++)
+			{
+				const pathtracer::BVHBackend backend = pathtracer::BVHBackend(b);
+				if(compareBackends ? !pathtracer::isBackendAvailable(backend) : backend != selected)
+					continue;
+				pathtracer::settings.bvh_backend = backend;
+				pathtracer::rebuildScene();
+				const pathtracer::CommitStats& commit = pathtracer::getCommitStats();
+				const pathtracer::RayThroughput throughput =
+				    pathtracer::measureRayThroughput(viewMatrix, projMatrix);
+				char flags_text[64] = "";
+#ifdef PATHTRACER_EMBREE
+				const unsigned flags = pathtracer::settings.embree_scene_flags;
+				if(backend == pathtracer::BVH_BACKEND_EMBREE)
+				{
+					snprintf(flags_text, sizeof(flags_text), "%s%s%s%s%s",
+					         flags & RTC_SCENE_COMPACT ? "compact " : "",
+					         flags & RTC_SCENE_COHERENT ? "coherent " : "",
+					         flags & RTC_SCENE_HIGH_QUALITY ? "hq " : "",
+					         flags & RTC_SCENE_ROBUST ? "robust " : "", flags == 0 ? "default " : "");
+				}
+#endif
+				char result[256];
+				snprintf(result, sizeof(result), "%s %s| %.1f ms, %.1f MB, %.1f / %.1f Mrays/s",
+				         backendNames[backend], flags_text, 1000.0 * commit.time,
+				         commit.memory / (1024.0 * 1024.0), throughput.primary, throughput.secondary);
+				bvhResults.push_back(result);
+			}
+			// Go back to the selected backend after comparing
+			if(pathtracer::settings.bvh_backend != selected)
+			{
+				pathtracer::settings.bvh_backend = selected;
+				pathtracer::rebuildScene();
+			}
+			rebuildBVH = false;
+			compareBackends = false;
+			pathtracer::restart();
+		}
+		renderThread.resume();
+	}
+	// Start rendering once the image has a size and the camera is set
+	if(!renderThread.isRunning())
+	{
+		renderThread.start();
+	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Copy the newest frame from the render thread (the pathtraced image,
+	// the denoised image, or the sample count heatmap) to texture for
+	// display. Only new frames, or new tone mapping, need an upload.
 	///////////////////////////////////////////////////////////////////////////
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	bool fresh;
+	frame = &renderThread.latestFrame(fresh);
+	pathtracer::ToneMapping frameToneMapping = toneMapping;
+	if(frame->heatmap)
+	{
+		// The heatmap colors are meant to be shown as they are
+		frameToneMapping = pathtracer::ToneMapping();
+		frameToneMapping.srgb = false;
+	}
+	static pathtracer::ToneMapping uploadedToneMapping;
+	const bool toneMappingChanged = frameToneMapping.exposure != uploadedToneMapping.exposure
+	                                || frameToneMapping.op != uploadedToneMapping.op
+	                                || frameToneMapping.srgb != uploadedToneMapping.srgb;
+	if(frame->width > 0 && (fresh || toneMappingChanged))
+	{
+		imageUploader.upload(&frame->image[0].x, frame->width, frame->height, frameToneMapping);
+		uploadedToneMapping = frameToneMapping;
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -163,8 +337,9 @@ void display(void)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
-	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	glUseProgram(shaderProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, imageUploader.getTexture());
 	labhelper::drawFullScreenQuad();
 }
 
@@ -213,7 +388,6 @@ bool handleEvents(void)
 			cameraDirection = vec3(pitch * yaw * vec4(cameraDirection, 0.0f));
 			g_prevMouseCoords.x = event.motion.x;
 			g_prevMouseCoords.y = event.motion.y;
-			pathtracer::restart();
 		}
 	}
 
@@ -226,32 +400,26 @@ bool handleEvents(void)
 		if(state[SDL_SCANCODE_W])
 		{
 			cameraPosition += deltaTime * speed * cameraDirection;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_S])
 		{
 			cameraPosition -= deltaTime * speed * cameraDirection;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_A])
 		{
 			cameraPosition -= deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_D])
 		{
 			cameraPosition += deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_Q])
 		{
 			cameraPosition -= deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_E])
 		{
 			cameraPosition += deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 	}
 
@@ -263,6 +431,25 @@ void gui()
 	// Inform imgui of new frame
 	ImGui_ImplSdlGL3_NewFrame(g_window);
 
+	///////////////////////////////////////////////////////////////////////////
+	// The widgets can only change something in the frame they are clicked
+	// (a slider jumps right away) or while they are active (dragged, typed
+	// into). Only then is the render thread paused, just hovering over the
+	// panel does not stop it. Everything about the rendering itself is read
+	// from the frame.
+	///////////////////////////////////////////////////////////////////////////
+	const ImGuiIO& io = ImGui::GetIO();
+	bool clicked = false;
+	for(int button = 0; button < 5; button++)
+	{
+		clicked |= io.MouseClicked[button];
+	}
+	const bool interacting = ImGui::IsAnyItemActive() || (clicked && io.WantCaptureMouse);
+	if(interacting)
+	{
+		pauseTime = renderThread.pause();
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Helpers for getting lists of materials and meshes into widgets
 	///////////////////////////////////////////////////////////////////////////
@@ -307,10 +494,189 @@ void gui()
 		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
 		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
 		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		ImGui::SliderInt("Tile Size", &pathtracer::settings.tile_size, 4, 64);
+		int tile_order = pathtracer::settings.tile_order;
+		if(ImGui::Combo("Tile Order", &tile_order, "Scanline\0Morton\0Spiral\0"))
+		{
+			pathtracer::settings.tile_order = pathtracer::TileOrder(tile_order);
+		}
+		int integrator = pathtracer::settings.integrator;
+		if(ImGui::Combo("Integrator", &integrator, "Path\0Wavefront\0"))
+		{
+			pathtracer::settings.integrator = pathtracer::Integrator(integrator);
+			pathtracer::restart();
+		}
+		ImGui::Checkbox("Trace Primary Rays As Packets", &pathtracer::settings.use_ray_packets);
+		if(ImGui::Checkbox("Antialiasing", &pathtracer::settings.antialiasing))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::SliderFloat("Lens Radius", &pathtracer::settings.lens_radius, 0.0f, 2.0f))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::SliderFloat("Focal Distance", &pathtracer::settings.focal_distance, 0.1f, 100.0f))
+		{
+			pathtracer::restart();
+		}
+		int sampler = pathtracer::settings.sampler;
+		if(ImGui::Combo("Sampler", &sampler, "Independent\0Stratified\0Halton\0Sobol (Owen scrambled)\0"))
+		{
+			pathtracer::settings.sampler = pathtracer::SamplerType(sampler);
+			pathtracer::restart();
+		}
+		ImGui::Checkbox("Adaptive Sampling", &pathtracer::settings.adaptive_sampling);
+		ImGui::SliderFloat("Adaptive Error Threshold", &pathtracer::settings.adaptive_threshold, 0.001f, 0.2f,
+		                   "%.3f", 2.0f);
+		ImGui::SliderFloat("Exposure", &toneMapping.exposure, -8.0f, 8.0f, "%.1f stops");
+		int toneMapOperator = toneMapping.op;
+		if(ImGui::Combo("Tone Mapping", &toneMapOperator, "Clamp\0Reinhard\0ACES\0"))
+		{
+			toneMapping.op = pathtracer::ToneMapOperator(toneMapOperator);
+		}
+		ImGui::Text("Tonemapping: %.2f ms", 1000.0 * imageUploader.getTonemapTime());
+		if(ImGui::Checkbox("Show Sample Heatmap", &showSampleHeatmap))
+		{
+			renderThread.setShowHeatmap(showSampleHeatmap);
+		}
+		if(ImGui::Checkbox("Denoise", &pathtracer::settings.denoise))
+		{
+			// The features are only gathered while denoising (or reprojecting)
+			pathtracer::restart();
+		}
+		if(ImGui::SliderInt("Denoiser Iterations", &pathtracer::settings.denoise_iterations, 1, 5))
+		{
+			renderThread.refresh();
+		}
+		if(pathtracer::settings.denoise)
+		{
+			ImGui::Text("Denoiser: %.1f ms", 1000.0 * frame->denoise_time);
+		}
+		if(ImGui::Checkbox("Progressive Refinement", &pathtracer::settings.progressive))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::settings.progressive)
+		{
+			ImGui::SliderFloat("Target Pass Time", &pathtracer::settings.target_pass_time, 5.0f, 200.0f,
+			                   "%.0f ms");
+		}
+		if(frame->progressive_stride > 1)
+		{
+			ImGui::Text("Refining: 1/%d resolution", frame->progressive_stride * frame->progressive_stride);
+		}
+		else
+		{
+			ImGui::Text("%d samples, %.1f%% pixels converged", frame->number_of_samples,
+			            100.0f * frame->converged_fraction);
+		}
 		if(ImGui::Button("Restart Pathtracing"))
 		{
 			pathtracer::restart();
 		}
+		ImGui::SliderInt("Cached Camera Hits", &pathtracer::settings.primary_cache_samples, 0, 16,
+		                 "%.0f samples");
+		if(pathtracer::settings.primary_cache_samples > 0)
+		{
+			ImGui::Text("Primary hit cache: %.1f MB, saved %.1f ms in the last pass",
+			            frame->cache_memory / (1024.0 * 1024.0), 1000.0 * frame->cache_saved_time);
+		}
+		if(ImGui::Checkbox("Reproject on Camera Motion", &pathtracer::settings.reprojection))
+		{
+			pathtracer::restart();
+		}
+		if(pathtracer::settings.reprojection)
+		{
+			ImGui::SliderInt("Max History", &pathtracer::settings.max_history, 1, 1024, "%.0f samples");
+			ImGui::Text("Reprojection: %.1f ms, %.0f%% of pixels kept samples", 1000.0 * reprojectionTime,
+			            100.0f * reprojectionKept);
+		}
+		ImGui::Text("Last pause: %.2f ms, restart to new image: %.1f ms", 1000.0 * pauseTime,
+		            1000.0 * frame->restart_latency);
+
+		///////////////////////////////////////////////////////////////////////
+		// How well the work was spread over the threads in the last pass
+		///////////////////////////////////////////////////////////////////////
+		const int num_threads = int(frame->thread_stats.size());
+		ImGui::Text("Pass: %.1f ms, %d tiles, %d threads", 1000.0 * frame->pass_time, frame->num_tiles,
+		            num_threads);
+		if(ImGui::TreeNode("Threads"))
+		{
+			for(int t = 0; t < num_threads; t++)
+			{
+				const pathtracer::ThreadStats& stats = frame->thread_stats[t];
+				ImGui::Text("%2d: busy %6.1f ms, idle %6.1f ms, %3d tiles (%d stolen)", t,
+				            1000.0 * stats.busy_time, 1000.0 * stats.idle_time, stats.tiles_rendered,
+				            stats.tiles_stolen);
+			}
+			ImGui::TreePop();
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// What the integrator did in the last pass, and since the last restart
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("Statistics", "statistics_ch", true, false))
+	{
+		const pathtracer::Statistics& stats = frame->statistics;
+		const pathtracer::PassStatistics& pass = stats.last_pass;
+		ImGui::Text("Last pass: %.1f ms, %.2f Mrays/s", 1000.0 * pass.time,
+		            pass.time > 0.0 ? pass.rays() / pass.time / 1e6 : 0.0);
+		ImGui::Text("%d passes since restart, %.2f Mrays/s on average", stats.passes,
+		            stats.total.time > 0.0 ? stats.total.rays() / stats.total.time / 1e6 : 0.0);
+		ImGui::Columns(3, "statistics_counters");
+		ImGui::Text("Counter");
+		ImGui::NextColumn();
+		ImGui::Text("Last pass");
+		ImGui::NextColumn();
+		ImGui::Text("Total");
+		ImGui::NextColumn();
+		ImGui::Separator();
+		for(int c = 0; c < pathtracer::COUNTER_COUNT; c++)
+		{
+			ImGui::Text("%s", pathtracer::counterName(pathtracer::Counter(c)));
+			ImGui::NextColumn();
+			ImGui::Text("%llu", (unsigned long long)pass.counters[c]);
+			ImGui::NextColumn();
+			ImGui::Text("%llu", (unsigned long long)stats.total.counters[c]);
+			ImGui::NextColumn();
+		}
+		ImGui::Columns(1);
+		const uint64_t traced = pass.counters[pathtracer::COUNTER_PRIMARY_RAYS]
+		                        + pass.counters[pathtracer::COUNTER_CACHED_HITS]
+		                        + pass.counters[pathtracer::COUNTER_SECONDARY_RAYS];
+		ImGui::Text("%.1f%% of the primary and secondary rays escaped",
+		            traced > 0 ? 100.0 * pass.counters[pathtracer::COUNTER_ESCAPED_RAYS] / traced : 0.0);
+
+		// Path lengths of the last pass, the last bin holds all longer paths
+		float path_lengths[pathtracer::MAX_PATH_LENGTH + 1];
+		for(int l = 0; l <= pathtracer::MAX_PATH_LENGTH; l++)
+		{
+			path_lengths[l] = float(pass.path_lengths[l]);
+		}
+		ImGui::PlotHistogram("Path lengths", path_lengths, pathtracer::MAX_PATH_LENGTH + 1, 0, nullptr, 0.0f,
+		                     FLT_MAX, ImVec2(0, 80));
+
+		if(ImGui::TreeNode("Per thread"))
+		{
+			for(int t = 0; t < int(stats.last_pass_threads.size()); t++)
+			{
+				// Busy time is only known when the tiled integrator rendered the pass
+				const double busy = t < int(frame->thread_stats.size()) ? frame->thread_stats[t].busy_time : 0.0;
+				ImGui::Text("%2d: %10llu rays, busy %6.1f ms", t,
+				            (unsigned long long)stats.last_pass_threads[t].rays(), 1000.0 * busy);
+			}
+			ImGui::TreePop();
+		}
+
+		bool write_csv = pathtracer::isStatisticsFileOpen();
+		if(ImGui::Checkbox("Write pathtracer_statistics.csv", &write_csv))
+		{
+			if(write_csv)
+				pathtracer::openStatisticsFile("pathtracer_statistics.csv");
+			else
+				pathtracer::closeStatisticsFile();
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -323,6 +689,22 @@ void gui()
 
 	if(ImGui::CollapsingHeader("Models", "meshes_ch", true, true))
 	{
+		ImGui::Checkbox("Animate Ship", &animateShip);
+		if(ImGui::Checkbox("Dynamic Geometry", &pathtracer::settings.dynamic_geometry))
+		{
+			deformShip = deformShip && pathtracer::settings.dynamic_geometry;
+			pathtracer::rebuildScene();
+			pathtracer::restart();
+		}
+		if(ImGui::Checkbox("Deform Ship", &deformShip) && deformShip && !pathtracer::settings.dynamic_geometry)
+		{
+			pathtracer::settings.dynamic_geometry = true;
+			pathtracer::rebuildScene();
+		}
+		ImGui::SliderFloat("Rebuild Threshold", &pathtracer::settings.rebuild_threshold, 1.0f, 4.0f);
+		const pathtracer::CommitStats& commit = pathtracer::getCommitStats();
+		ImGui::Text("Last BVH commit: %.2f ms (%s, quality %.2f)", 1000.0 * commit.time,
+		            commit.refit ? "refit" : "rebuild", commit.quality);
 		if(ImGui::Combo("Model", &model_index, model_getter, (void*)&models, int(models.size())))
 		{
 			model = models[model_index].first;
@@ -354,6 +736,8 @@ void gui()
 			                int(model->m_materials.size())))
 			{
 				mesh.m_material_idx = material_index;
+				pathtracer::updateMaterials();
+				pathtracer::restart();
 			}
 		}
 
@@ -371,13 +755,19 @@ void gui()
 			{
 				material.m_name = name;
 			}
-			ImGui::ColorEdit3("Color", &material.m_color.x);
-			ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
-			ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-			ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-			ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
-			ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
-			ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			bool changed = false;
+			changed |= ImGui::ColorEdit3("Color", &material.m_color.x);
+			changed |= ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
+			changed |= ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
+			changed |= ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
+			changed |= ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
+			changed |= ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
+			changed |= ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			if(changed)
+			{
+				pathtracer::updateMaterials();
+				pathtracer::restart();
+			}
 
 			///////////////////////////////////////////////////////////////////////////
 			// A button for saving your results
@@ -389,18 +779,75 @@ void gui()
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// BVH backend and embree build settings. They take effect when the BVH
+	// is rebuilt, which also measures build time, memory and ray throughput
+	// (primary / secondary) for comparison.
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("BVH", "embree_ch", true, false))
+	{
+		int backend = pathtracer::settings.bvh_backend;
+		for(int b = 0; b < pathtracer::BVH_BACKEND_COUNT; b++)
+		{
+			if(!pathtracer::isBackendAvailable(pathtracer::BVHBackend(b)))
+				continue;
+			if(b > 0)
+				ImGui::SameLine();
+			if(ImGui::RadioButton(backendNames[b], &backend, b))
+			{
+				pathtracer::settings.bvh_backend = pathtracer::BVHBackend(backend);
+			}
+		}
+#ifdef PATHTRACER_EMBREE
+		unsigned& scene_flags = pathtracer::settings.embree_scene_flags;
+		ImGui::CheckboxFlags("Compact", &scene_flags, RTC_SCENE_COMPACT);
+		ImGui::CheckboxFlags("Coherent", &scene_flags, RTC_SCENE_COHERENT);
+		ImGui::CheckboxFlags("High Quality", &scene_flags, RTC_SCENE_HIGH_QUALITY);
+		ImGui::CheckboxFlags("Robust", &scene_flags, RTC_SCENE_ROBUST);
+		unsigned& algorithm_flags = pathtracer::settings.embree_algorithm_flags;
+		ImGui::CheckboxFlags("Packets (intersect8)", &algorithm_flags, RTC_INTERSECT8);
+		ImGui::CheckboxFlags("Streams (intersect1M)", &algorithm_flags, RTC_INTERSECT_STREAM);
+#endif
+		ImGui::SliderInt("Threads (0 = all)", &pathtracer::settings.embree_threads, 0, 64);
+		if(ImGui::Button("Rebuild BVH"))
+		{
+			rebuildBVH = true;
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Compare backends"))
+		{
+			compareBackends = true;
+		}
+		const pathtracer::CommitStats& commit = pathtracer::getCommitStats();
+		ImGui::Text("Last commit: %.2f ms, %.1f MB", 1000.0 * commit.time, commit.memory / (1024.0 * 1024.0));
+		for(auto& result : bvhResults)
+		{
+			ImGui::Text("%s", result.c_str());
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Light and environment map
 	///////////////////////////////////////////////////////////////////////////
 	if(ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier,
-		                   0.0f, 10000.0f);
+		bool changed = false;
+		changed |=
+		    ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
+		changed |= ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
+		changed |= ImGui::SliderFloat("Point light intensity multiplier",
+		                              &pathtracer::point_light.intensity_multiplier, 0.0f, 10000.0f);
+		if(changed)
+		{
+			pathtracer::restart();
+		}
 	}
 
 	ImGui::End(); // Control Panel
+	if(interacting)
+	{
+		renderThread.resume();
+	}
 
 	// Render the GUI.
 	ImGui::Render();
@@ -435,11 +882,13 @@ int main(int argc, char* argv[])
 		stopRendering = handleEvents();
 	}
 
+	renderThread.stop();
 	// Delete Models
 	for(auto& m : models)
 	{
 		labhelper::freeModel(m.first);
 	}
+	imageUploader.destroy();
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
 	return 0;
@@ -1,8 +1,69 @@
 #include "material.h"
 #include "sampling.h"
+#include <cmath>
 
 namespace pathtracer
 {
+///////////////////////////////////////////////////////////////////////////
+// Building blocks of the Blinn Phong microfacet brdf, shared by the BRDF
+// classes and the flat material kernels.
+///////////////////////////////////////////////////////////////////////////
+// Schlick's approximation of the fresnel term
+static inline float fresnel(float wh_wi, float R0)
+{
+	return R0 + (1.0f - R0) * pow(1.0f - max(0.0f, wh_wi), 5.0f);
+}
+
+// The microfacet term D * G / (4 * (n.wo) * (n.wi)), without fresnel
+static inline float microfacet(float n_wi, float n_wo, float n_wh, float wo_wh, float shininess)
+{
+	if(n_wi <= 0.0f || n_wo <= 0.0f || wo_wh <= 0.0f)
+		return 0.0f;
+	const float D = (shininess + 2.0f) / (2.0f * M_PI) * pow(max(0.0f, n_wh), shininess);
+	const float G = min(1.0f, min(2.0f * n_wh * n_wo / wo_wh, 2.0f * n_wh * n_wi / wo_wh));
+	return D * G / max(4.0f * n_wo * n_wi, 0.0001f);
+}
+
+// The pdf of sampleLobe()
+static inline float lobePdf(float n_wh, float wo_wh, float shininess)
+{
+	if(wo_wh <= 0.0f)
+		return 0.0f;
+	const float p_wh = (shininess + 1.0f) * pow(max(0.0f, n_wh), shininess) / (2.0f * M_PI);
+	return p_wh / (4.0f * wo_wh);
+}
+
+// Sample a microfacet normal and reflect wo in it
+static inline vec3 sampleLobe(const vec3& wo, const vec3& n, float shininess)
+{
+	vec3 tangent = normalize(perpendicular(n));
+	vec3 bitangent = normalize(cross(tangent, n));
+	const float phi = 2.0f * M_PI * randf();
+	const float cos_theta = pow(randf(), 1.0f / (shininess + 1.0f));
+	const float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
+	vec3 wh = normalize(sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent + cos_theta * n);
+	return normalize(2.0f * dot(wo, wh) * wh - wo);
+}
+
+static inline vec3 sampleCosine(const vec3& n)
+{
+	vec3 tangent = normalize(perpendicular(n));
+	vec3 bitangent = normalize(cross(tangent, n));
+	vec3 sample = cosineSampleHemisphere();
+	return normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
+}
+
+// The half vector, and whether it exists
+static inline bool halfVector(const vec3& wi, const vec3& wo, vec3& wh)
+{
+	wh = wi + wo;
+	const float l = length(wh);
+	if(l <= 0.0f)
+		return false;
+	wh /= l;
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // A Lambertian (diffuse) material
 ///////////////////////////////////////////////////////////////////////////
@@ -17,10 +78,7 @@ vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n)
 
 vec3 Diffuse::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 {
-	vec3 tangent = normalize(perpendicular(n));
-	vec3 bitangent = normalize(cross(tangent, n));
-	vec3 sample = cosineSampleHemisphere();
-	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
+	wi = sampleCosine(n);
 	if(dot(wi, n) <= 0.0f)
 		p = 0.0f;
 	else
@@ -28,16 +86,28 @@ vec3 Diffuse::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 	return f(wi, wo, n);
 }
 
+float Diffuse::pdf(const vec3& wi, const vec3& wo, const vec3& n)
+{
+	return max(0.0f, dot(n, wi)) / M_PI;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // A Blinn Phong Dielectric Microfacet BRFD
 ///////////////////////////////////////////////////////////////////////////
 vec3 BlinnPhong::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	vec3 wh;
+	if(refraction_layer == NULL || !halfVector(wi, wo, wh))
+		return vec3(0.0f);
+	return (1.0f - fresnel(dot(wh, wi), R0)) * refraction_layer->f(wi, wo, n);
 }
 vec3 BlinnPhong::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	vec3 wh;
+	if(!halfVector(wi, wo, wh))
+		return vec3(0.0f);
+	const float F = fresnel(dot(wh, wi), R0);
+	return vec3(F * microfacet(dot(n, wi), dot(n, wo), dot(n, wh), dot(wo, wh), shininess));
 }
 
 vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
@@ -45,19 +115,34 @@ vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
 	return reflection_brdf(wi, wo, n) + refraction_brdf(wi, wo, n);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// With a refraction layer, half of the samples go to the microfacet lobe
+// and half to the layer.
+///////////////////////////////////////////////////////////////////////////
 vec3 BlinnPhong::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 {
-	vec3 tangent = normalize(perpendicular(n));
-	vec3 bitangent = normalize(cross(tangent, n));
-	vec3 sample = cosineSampleHemisphere();
-	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-	if(dot(wi, n) <= 0.0f)
-		p = 0.0f;
+	if(refraction_layer == NULL || randf() < 0.5f)
+	{
+		wi = sampleLobe(wo, n, shininess);
+	}
 	else
-		p = max(0.0f, dot(n, wi)) / M_PI;
+	{
+		float layer_pdf;
+		refraction_layer->sample_wi(wi, wo, n, layer_pdf);
+	}
+	p = pdf(wi, wo, n);
 	return f(wi, wo, n);
 }
 
+float BlinnPhong::pdf(const vec3& wi, const vec3& wo, const vec3& n)
+{
+	vec3 wh;
+	const float lobe = halfVector(wi, wo, wh) ? lobePdf(dot(n, wh), dot(wo, wh), shininess) : 0.0f;
+	if(refraction_layer == NULL)
+		return lobe;
+	return 0.5f * lobe + 0.5f * refraction_layer->pdf(wi, wo, n);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
 ///////////////////////////////////////////////////////////////////////////
@@ -75,13 +160,260 @@ vec3 BlinnPhongMetal::reflection_brdf(const vec3& wi, const vec3& wo, const vec3
 ///////////////////////////////////////////////////////////////////////////
 vec3 LinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0);
+	return w * bsdf0->f(wi, wo, n) + (1.0f - w) * bsdf1->f(wi, wo, n);
 }
 
 vec3 LinearBlend::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
 {
-	p = 0.0f;
-	return vec3(0.0f);
+	float component_pdf;
+	if(randf() < w)
+		bsdf0->sample_wi(wi, wo, n, component_pdf);
+	else
+		bsdf1->sample_wi(wi, wo, n, component_pdf);
+	p = pdf(wi, wo, n);
+	return f(wi, wo, n);
+}
+
+float LinearBlend::pdf(const vec3& wi, const vec3& wo, const vec3& n)
+{
+	return w * bsdf0->pdf(wi, wo, n) + (1.0f - w) * bsdf1->pdf(wi, wo, n);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The brdf tree of a scene material
+///////////////////////////////////////////////////////////////////////////
+MaterialTree::MaterialTree(const labhelper::Material& material)
+    : diffuse(material.m_color)
+    , dielectric(material.m_shininess, material.m_fresnel, &diffuse)
+    , metal(material.m_color, material.m_shininess, material.m_fresnel)
+    , metal_blend(material.m_metalness, &metal, &dielectric)
+    , reflectivity_blend(material.m_reflectivity, &metal_blend, &diffuse)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Flat materials
+///////////////////////////////////////////////////////////////////////////
+std::vector<MaterialRecord> material_table;
+
+MaterialRecord compileMaterial(const labhelper::Material& material)
+{
+	MaterialRecord m;
+	m.color = material.m_color;
+	m.emission = material.m_emission;
+	m.shininess = material.m_shininess;
+	m.R0 = material.m_fresnel;
+	m.metalness = material.m_metalness;
+	m.reflectivity = material.m_reflectivity;
+	if(m.reflectivity <= 0.0f)
+		m.type = MATERIAL_DIFFUSE;
+	else if(m.reflectivity >= 1.0f && m.metalness >= 1.0f)
+		m.type = MATERIAL_METAL;
+	else
+		m.type = MATERIAL_LAYERED;
+	return m;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Everything the kernels need to know about a pair of directions
+///////////////////////////////////////////////////////////////////////////
+struct Geometry
+{
+	float n_wi, n_wo, n_wh, wo_wh, F;
+	Geometry(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
+	{
+		vec3 wh;
+		n_wi = dot(n, wi);
+		n_wo = dot(n, wo);
+		if(halfVector(wi, wo, wh))
+		{
+			n_wh = dot(n, wh);
+			wo_wh = dot(wo, wh);
+		}
+		else
+		{
+			n_wh = wo_wh = 0.0f;
+		}
+		F = fresnel(wo_wh, m.R0);
+	}
+	// From the dot products, worked out elsewhere
+	Geometry(const MaterialRecord& m, float n_wi, float n_wo, float n_wh, float wo_wh)
+	    : n_wi(n_wi), n_wo(n_wo), n_wh(n_wh), wo_wh(wo_wh), F(fresnel(wo_wh, m.R0))
+	{
+	}
+	float diffuse() const
+	{
+		return (n_wi > 0.0f && n_wo > 0.0f) ? 1.0f / M_PI : 0.0f;
+	}
+	float diffusePdf() const
+	{
+		return max(0.0f, n_wi) / M_PI;
+	}
+	float specular(const MaterialRecord& m) const
+	{
+		return F * microfacet(n_wi, n_wo, n_wh, wo_wh, m.shininess);
+	}
+	float specularPdf(const MaterialRecord& m) const
+	{
+		return lobePdf(n_wh, wo_wh, m.shininess);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// One kernel per material type. evaluate() returns the brdf and sets the
+// pdf, sample() picks a direction the same way the MaterialTree does.
+///////////////////////////////////////////////////////////////////////////
+template <MaterialType T>
+struct MaterialKernel;
+
+template <>
+struct MaterialKernel<MATERIAL_DIFFUSE>
+{
+	static vec3 evaluate(const MaterialRecord& m, const Geometry& g, float& p)
+	{
+		p = g.diffusePdf();
+		return m.color * g.diffuse();
+	}
+	static vec3 sample(const MaterialRecord& m, const vec3& wo, const vec3& n)
+	{
+		return sampleCosine(n);
+	}
+};
+
+template <>
+struct MaterialKernel<MATERIAL_METAL>
+{
+	static vec3 evaluate(const MaterialRecord& m, const Geometry& g, float& p)
+	{
+		p = g.specularPdf(m);
+		return m.color * g.specular(m);
+	}
+	static vec3 sample(const MaterialRecord& m, const vec3& wo, const vec3& n)
+	{
+		return sampleLobe(wo, n, m.shininess);
+	}
+};
+
+template <>
+struct MaterialKernel<MATERIAL_LAYERED>
+{
+	static vec3 evaluate(const MaterialRecord& m, const Geometry& g, float& p)
+	{
+		const float r = m.reflectivity, mt = m.metalness;
+		const float specular = g.specular(m), specular_pdf = g.specularPdf(m);
+		const vec3 diffuse = m.color * g.diffuse();
+		const vec3 metal = m.color * specular;
+		const vec3 dielectric = vec3(specular) + (1.0f - g.F) * diffuse;
+		const float dielectric_pdf = 0.5f * specular_pdf + 0.5f * g.diffusePdf();
+		p = r * (mt * specular_pdf + (1.0f - mt) * dielectric_pdf) + (1.0f - r) * g.diffusePdf();
+		return r * (mt * metal + (1.0f - mt) * dielectric) + (1.0f - r) * diffuse;
+	}
+	static vec3 sample(const MaterialRecord& m, const vec3& wo, const vec3& n)
+	{
+		if(randf() < m.reflectivity)
+		{
+			if(randf() < m.metalness || randf() < 0.5f)
+				return sampleLobe(wo, n, m.shininess);
+		}
+		return sampleCosine(n);
+	}
+};
+
+template <MaterialType T>
+static vec3 sampleKernel(const MaterialRecord& m, vec3& wi, const vec3& wo, const vec3& n, float& p)
+{
+	wi = MaterialKernel<T>::sample(m, wo, n);
+	return MaterialKernel<T>::evaluate(m, Geometry(m, wi, wo, n), p);
+}
+
+static vec3 evaluateMaterial(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n, float& p)
+{
+	const Geometry g(m, wi, wo, n);
+	switch(m.type)
+	{
+	case MATERIAL_DIFFUSE: return MaterialKernel<MATERIAL_DIFFUSE>::evaluate(m, g, p);
+	case MATERIAL_METAL: return MaterialKernel<MATERIAL_METAL>::evaluate(m, g, p);
+	default: return MaterialKernel<MATERIAL_LAYERED>::evaluate(m, g, p);
+	}
+}
+
+vec3 materialF(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
+{
+	float p;
+	return evaluateMaterial(m, wi, wo, n, p);
+}
+
+float materialPdf(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
+{
+	float p;
+	evaluateMaterial(m, wi, wo, n, p);
+	return p;
+}
+
+vec3 materialSampleWi(const MaterialRecord& m, vec3& wi, const vec3& wo, const vec3& n, float& p)
+{
+	switch(m.type)
+	{
+	case MATERIAL_DIFFUSE: return sampleKernel<MATERIAL_DIFFUSE>(m, wi, wo, n, p);
+	case MATERIAL_METAL: return sampleKernel<MATERIAL_METAL>(m, wi, wo, n, p);
+	default: return sampleKernel<MATERIAL_LAYERED>(m, wi, wo, n, p);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Eight lanes at a time. The dot products of all lanes are worked out
+// first, one array each, in loops without branches. Then the lanes are
+// sorted into one list per material type, and each list runs the kernel
+// of its type.
+///////////////////////////////////////////////////////////////////////////
+struct BatchGeometry8
+{
+	float n_wi[8], n_wo[8], n_wh[8], wo_wh[8];
+};
+
+template <MaterialType T>
+static void evaluateLanes(MaterialBatch8& batch, const BatchGeometry8& g, const int lanes[8], int num_lanes)
+{
+	for(int k = 0; k < num_lanes; k++)
+	{
+		const int l = lanes[k];
+		const MaterialRecord& m = material_table[batch.material[l]];
+		const Geometry geometry(m, g.n_wi[l], g.n_wo[l], g.n_wh[l], g.wo_wh[l]);
+		const vec3 f = MaterialKernel<T>::evaluate(m, geometry, batch.pdf[l]);
+		batch.f[0][l] = f.x;
+		batch.f[1][l] = f.y;
+		batch.f[2][l] = f.z;
+	}
+}
+
+void evaluateMaterials8(MaterialBatch8& batch)
+{
+	const float(&wi)[3][8] = batch.wi;
+	const float(&wo)[3][8] = batch.wo;
+	const float(&n)[3][8] = batch.n;
+	BatchGeometry8 g;
+	for(int l = 0; l < batch.count; l++)
+	{
+		g.n_wi[l] = n[0][l] * wi[0][l] + n[1][l] * wi[1][l] + n[2][l] * wi[2][l];
+		g.n_wo[l] = n[0][l] * wo[0][l] + n[1][l] * wo[1][l] + n[2][l] * wo[2][l];
+		const float hx = wi[0][l] + wo[0][l], hy = wi[1][l] + wo[1][l], hz = wi[2][l] + wo[2][l];
+		const float length = sqrt(hx * hx + hy * hy + hz * hz);
+		// Zero if there is no half vector, like halfVector()
+		const float scale = length > 0.0f ? 1.0f / length : 0.0f;
+		g.n_wh[l] = (n[0][l] * hx + n[1][l] * hy + n[2][l] * hz) * scale;
+		g.wo_wh[l] = (wo[0][l] * hx + wo[1][l] * hy + wo[2][l] * hz) * scale;
+	}
+
+	int lanes[MATERIAL_TYPE_COUNT][8];
+	int num_lanes[MATERIAL_TYPE_COUNT] = {};
+	for(int l = 0; l < batch.count; l++)
+	{
+		const MaterialType type = material_table[batch.material[l]].type;
+		lanes[type][num_lanes[type]++] = l;
+	}
+	evaluateLanes<MATERIAL_DIFFUSE>(batch, g, lanes[MATERIAL_DIFFUSE], num_lanes[MATERIAL_DIFFUSE]);
+	evaluateLanes<MATERIAL_METAL>(batch, g, lanes[MATERIAL_METAL], num_lanes[MATERIAL_METAL]);
+	evaluateLanes<MATERIAL_LAYERED>(batch, g, lanes[MATERIAL_LAYERED], num_lanes[MATERIAL_LAYERED]);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1,5 +1,7 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
 #include "Pathtracer.h"
 #include "sampling.h"
 
@@ -18,6 +20,8 @@ public:
 	// Sample a suitable direction and return the brdf in that direction as
 	// well as the pdf (~probability) that the direction was chosen.
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) = 0;
+	// Return the pdf (~probability) that sample_wi() picks wi
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -32,6 +36,7 @@ public:
 	}
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -51,6 +56,7 @@ public:
 	virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
 ///////////////////////////////////////////////////////////////////////////
@@ -79,6 +85,85 @@ public:
 	LinearBlend(float _w, BRDF* a, BRDF* b) : w(_w), bsdf0(a), bsdf1(b){};
 	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
 	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	virtual float pdf(const vec3& wi, const vec3& wo, const vec3& n) override;
 };
 
-} // namespace pathtracer
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////
+// The brdf tree of a scene material:
+//     reflectivity * (metalness * metal + (1 - metalness) * dielectric)
+//   + (1 - reflectivity) * diffuse
+// where the dielectric is a Blinn Phong layer on top of the diffuse.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialTree
+{
+	Diffuse diffuse;
+	BlinnPhong dielectric;
+	BlinnPhongMetal metal;
+	LinearBlend metal_blend;
+	LinearBlend reflectivity_blend;
+	MaterialTree(const labhelper::Material& material);
+	MaterialTree(const MaterialTree&) = delete;
+	BRDF& brdf()
+	{
+		return reflectivity_blend;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Flat materials. Every scene material is compiled once into a
+// MaterialRecord, which describes the same brdf as its MaterialTree.
+// Evaluation picks a kernel for the type of material, without building
+// objects or making virtual calls per hit. The classes above stay as the
+// reference implementation.
+///////////////////////////////////////////////////////////////////////////
+enum MaterialType : uint32_t
+{
+	MATERIAL_DIFFUSE = 0, // reflectivity == 0
+	MATERIAL_METAL,       // reflectivity == 1 and metalness == 1
+	MATERIAL_LAYERED,     // Any other blend
+	MATERIAL_TYPE_COUNT
+};
+
+struct MaterialRecord
+{
+	vec3 color;
+	float emission;
+	float shininess;
+	float R0;
+	float metalness;
+	float reflectivity;
+	MaterialType type;
+};
+
+MaterialRecord compileMaterial(const labhelper::Material& material);
+
+// The compiled materials of all models in the scene, filled in as models
+// are added. Intersection::material_index points into it.
+extern std::vector<MaterialRecord> material_table;
+
+// Same as BRDF::f(), BRDF::sample_wi() and BRDF::pdf()
+vec3 materialF(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n);
+vec3 materialSampleWi(const MaterialRecord& m, vec3& wi, const vec3& wo, const vec3& n, float& p);
+float materialPdf(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n);
+
+///////////////////////////////////////////////////////////////////////////
+// Evaluate the brdf and pdf of up to eight hits at once. Vectors are
+// stored as one array per component. The lanes are grouped by material
+// type and each group runs the kernel of its type, so that diffuse and
+// metal lanes do not pay for the layered kernel.
+///////////////////////////////////////////////////////////////////////////
+struct MaterialBatch8
+{
+	// Input
+	int count = 0;        // Lanes in use
+	uint32_t material[8]; // Into material_table
+	float wi[3][8];
+	float wo[3][8];
+	float n[3][8];
+	// Output
+	float f[3][8];
+	float pdf[8];
+};
+void evaluateMaterials8(MaterialBatch8& batch);
+
+} // namespace pathtracer
@@ -0,0 +1,133 @@
+#include "reprojection.h"
+#include "Pathtracer.h"
+#include "Camera.h"
+#include "statistics.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// An old pixel saw the same surface if its first-hit depth is within
+// DEPTH_TOLERANCE of the distance to the new hit (relative), and its
+// normal within about 25 degrees of the new one. Pixels whose matching
+// bilinear weights add up to less than MIN_WEIGHT start over.
+///////////////////////////////////////////////////////////////////////////
+static const float DEPTH_TOLERANCE = 0.05f;
+static const float MIN_NORMAL_COSINE = 0.9f;
+static const float MIN_WEIGHT = 0.01f;
+static const int CHUNK = 256;
+
+// The image as it was before reproject(), and the new camera rays
+static vector<vec3> old_data, old_normal;
+static vector<int> old_sample_count;
+static vector<float> old_luminance_m2, old_depth;
+static vector<Ray> rays;
+
+static bool sameSurface(int j, bool hit, float distance, const vec3& normal)
+{
+	if(!hit)
+		return old_depth[j] == 0.0f;
+	return old_depth[j] > 0.0f && std::abs(old_depth[j] - distance) < DEPTH_TOLERANCE * distance
+	       && dot(old_normal[j], normal) > MIN_NORMAL_COSINE * length(old_normal[j]);
+}
+
+float reproject(const mat4& old_V, const mat4& old_P, const mat4& V, const mat4& P)
+{
+	const int width = rendered_image.width, height = rendered_image.height;
+	const int num_pixels = width * height;
+	old_data.swap(rendered_image.data);
+	old_normal.swap(rendered_image.normal);
+	old_sample_count.swap(rendered_image.sample_count);
+	old_luminance_m2.swap(rendered_image.luminance_m2);
+	old_depth.swap(rendered_image.depth);
+	rendered_image.resize(width, height);
+
+	///////////////////////////////////////////////////////////////////////
+	// What the center of each new pixel sees, without depth of field
+	///////////////////////////////////////////////////////////////////////
+	Camera camera;
+	camera.setup(V, P, width, height);
+	CameraSample center;
+	center.pixel = vec2(0.5f);
+	center.lens = vec2(0.5f);
+	rays.resize(num_pixels);
+	const int num_chunks = (num_pixels + CHUNK - 1) / CHUNK;
+#pragma omp parallel for schedule(dynamic)
+	for(int c = 0; c < num_chunks; c++)
+	{
+		const int first = c * CHUNK, count = std::min(CHUNK, num_pixels - first);
+		for(int i = first; i < first + count; i++)
+		{
+			rays[i] = camera.generateRay(i % width, i / width, center);
+		}
+		intersect(&rays[first], count, true);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Gather each new pixel from the old pixels around the point it sees
+	///////////////////////////////////////////////////////////////////////
+	const mat4 old_PV = old_P * old_V;
+	const vec3 old_position = vec3(inverse(old_V)[3]);
+	int num_kept = 0;
+#pragma omp parallel for schedule(dynamic, CHUNK) reduction(+ : num_kept)
+	for(int i = 0; i < num_pixels; i++)
+	{
+		const Ray& ray = rays[i];
+		const bool hit = ray.geomID != RTC_INVALID_GEOMETRY_ID;
+		const PixelFeatures features = pixelFeatures(ray);
+		rendered_image.albedo[i] = features.albedo;
+		rendered_image.normal[i] = features.normal;
+		rendered_image.depth[i] = features.depth;
+
+		// The environment is projected as a point at infinity
+		const vec3 p = ray.o + ray.tfar * ray.d;
+		const vec4 clip = hit ? old_PV * vec4(p, 1.0f) : old_PV * vec4(ray.d, 0.0f);
+		const float distance = hit ? length(p - old_position) : 0.0f;
+		vec3 color = vec3(0.0f);
+		float weight = 0.0f, history = 0.0f, variance = 0.0f;
+		if(clip.w > 0.0f)
+		{
+			const float px = (0.5f * clip.x / clip.w + 0.5f) * float(width) - 0.5f;
+			const float py = (0.5f * clip.y / clip.w + 0.5f) * float(height) - 0.5f;
+			const float x0 = floor(px), y0 = floor(py);
+			const float fx = px - x0, fy = py - y0;
+			for(int dy = 0; dy < 2; dy++)
+			{
+				for(int dx = 0; dx < 2; dx++)
+				{
+					const int x = int(x0) + dx, y = int(y0) + dy;
+					if(x < 0 || x >= width || y < 0 || y >= height)
+						continue;
+					const int j = y * width + x;
+					const int n = old_sample_count[j];
+					if(n == 0 || !sameSurface(j, hit, distance, features.normal))
+						continue;
+					const float w = (dx ? fx : 1.0f - fx) * (dy ? fy : 1.0f - fy);
+					weight += w;
+					color += w * old_data[j];
+					history += w * float(n);
+					variance += n > 1 ? w * old_luminance_m2[j] / float(n - 1) : 0.0f;
+				}
+			}
+		}
+		const int n = weight >= MIN_WEIGHT ? std::min(settings.max_history, int(history + 0.5f)) : 0;
+		rendered_image.sample_count[i] = n;
+		if(n > 0)
+		{
+			rendered_image.data[i] = color / weight;
+			rendered_image.luminance_m2[i] = variance / weight * float(n - 1);
+			num_kept++;
+		}
+	}
+
+	rendered_image.number_of_samples = 0;
+	rendered_image.converged_fraction = 0.0f;
+	rendered_image.progressive_stride = 0;
+	resetStatistics();
+	pass_gate.cancel();
+	return float(num_kept) / float(std::max(1, num_pixels));
+}
+} // namespace pathtracer
@@ -0,0 +1,20 @@
+#pragma once
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Instead of restart(), carry the accumulated image over to a new view.
+// A camera ray through the center of each new pixel finds what the pixel
+// sees first. That point is projected into the old view, and the pixel
+// takes over the bilinear mix of the old pixels around it that saw the
+// same surface (same first-hit depth and normal), or the environment in
+// the same direction. The pixel keeps as many samples as the mix is
+// worth: the bilinear weights of the old pixels that matched times their
+// sample counts, at most settings.max_history. Everything else starts
+// over. Needs the first-hit features, which are gathered while
+// settings.reprojection is on. Cancels the pass in flight like
+// restart(), and returns the fraction of pixels that kept samples.
+///////////////////////////////////////////////////////////////////////////
+float reproject(const glm::mat4& old_V, const glm::mat4& old_P, const glm::mat4& V, const glm::mat4& P);
+} // namespace pathtracer
@@ -1,22 +1,278 @@
 #include "sampling.h"
-#include <random>
-#include "labhelper.h"
-#include <omp.h>
+#include <cstdint>
+#include <algorithm>
 #include <iostream>
 #include <glm/glm.hpp>
 
+// Sometimes it exists, sometimes not...
+#ifndef M_PI
+#define M_PI 3.14159265358979323846f
+#endif
+
 using namespace glm;
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////////
-// Get a random float. Note that we need one "generator" per thread, or we
-// would need to lock everytime someone called randf().
+// Scramble the bits of a 64 bit integer (the SplitMix64 finalizer)
+///////////////////////////////////////////////////////////////////////////////
+static inline uint64_t hash64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline uint32_t hash(uint32_t a, uint32_t b, uint32_t c = 0)
+{
+	return uint32_t(hash64((uint64_t(a) << 32 | b) ^ hash64(c)));
+}
+
+// The top 24 bits as a float in [0,1), which is all the precision it has
+static inline float toFloat(uint32_t bits)
+{
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Independent samples
+///////////////////////////////////////////////////////////////////////////////
+float IndependentSampler::sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const
+{
+	return toFloat(hash(pixel, sample_index, dimension));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A random permutation of [0, length) indexed by i, for the seed p
+// ("Correlated Multi-Jittered Sampling", Kensler 2013).
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t permute(uint32_t i, uint32_t length, uint32_t p)
+{
+	uint32_t w = length - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do
+	{
+		i ^= p;
+		i *= 0xe170893d;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3f;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3df;
+		i &= w;
+		i ^= i >> 5;
+	} while(i >= length);
+	return (i + p) % length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stratified samples
+///////////////////////////////////////////////////////////////////////////////
+StratifiedSampler::StratifiedSampler(uint32_t samples_per_round)
+{
+	m_strata = 1;
+	while((m_strata + 1) * (m_strata + 1) <= samples_per_round)
+		m_strata++;
+}
+
+float StratifiedSampler::sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const
+{
+	const uint32_t cells = m_strata * m_strata;
+	const uint32_t round = sample_index / cells;
+	const uint32_t seed = hash(pixel, round, dimension / 2);
+	const uint32_t cell = permute(sample_index % cells, cells, seed);
+	const uint32_t stratum = (dimension & 1) ? cell / m_strata : cell % m_strata;
+	const float jitter = toFloat(hash(pixel, sample_index, dimension));
+	return (float(stratum) + jitter) / float(m_strata);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Halton samples
+///////////////////////////////////////////////////////////////////////////////
+// One base per dimension, enough for RANDOM_PATH plus the dimensions of 17
+// bounces. Dimensions past the end get independent random numbers, wrapping
+// around would reuse the sequence of dimension 0 with only another shift.
+static const uint32_t primes[] = { 2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+	                               43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+	                               103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+	                               173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239,
+	                               241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311, 313,
+	                               317, 331, 337, 347, 349, 353, 359, 367, 373, 379, 383, 389, 397,
+	                               401, 409, 419, 421, 431, 433, 439, 443, 449, 457, 461, 463, 467,
+	                               479, 487, 491, 499, 503, 509, 521, 523, 541, 547, 557, 563, 569,
+	                               571, 577, 587, 593, 599, 601, 607, 613, 617, 619, 631, 641, 643,
+	                               647, 653, 659, 661, 673, 677, 683, 691, 701, 709, 719, 727, 733,
+	                               739, 743, 751, 757, 761, 769, 773, 787, 797, 809 };
+static const uint32_t num_primes = sizeof(primes) / sizeof(primes[0]);
+
+static float radicalInverse(uint32_t base, uint32_t i)
+{
+	const float inv_base = 1.0f / float(base);
+	float inv_base_n = 1.0f;
+	uint32_t reversed = 0;
+	while(i)
+	{
+		const uint32_t next = i / base;
+		reversed = reversed * base + (i - next * base);
+		inv_base_n *= inv_base;
+		i = next;
+	}
+	return std::min(float(reversed) * inv_base_n, 0.99999994f);
+}
+
+float HaltonSampler::sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const
+{
+	if(dimension >= num_primes)
+		return toFloat(hash(pixel, sample_index, dimension));
+	const float value = radicalInverse(primes[dimension], sample_index);
+	const float shift = toFloat(hash(pixel, dimension, 0x4a1));
+	const float shifted = value + shift;
+	return shifted >= 1.0f ? shifted - 1.0f : shifted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Owen-scrambled Sobol samples
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t reverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+	x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+	x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+	x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+	return x;
+}
+
+// The second Sobol dimension (the first is reverseBits(i))
+static inline uint32_t sobol2(uint32_t i)
+{
+	uint32_t result = 0;
+	for(uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+	{
+		if(i & 1)
+			result ^= v;
+	}
+	return result;
+}
+
+// Owen scrambling, bits are flipped depending on all higher bits
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+float SobolSampler::sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const
+{
+	const uint32_t seed = hash(pixel, dimension / 2, 0x50b);
+	const uint32_t index = nestedUniformScramble(sample_index, seed);
+	const uint32_t x = (dimension & 1) ? sobol2(index) : reverseBits(index);
+	return toFloat(nestedUniformScramble(x, hash(seed, dimension & 1)));
+}
+
+Sampler* getSampler(SamplerType type)
+{
+	static IndependentSampler independent;
+	static StratifiedSampler stratified;
+	static HaltonSampler halton;
+	static SobolSampler sobol;
+	switch(type)
+	{
+	case SAMPLER_STRATIFIED:
+		return &stratified;
+	case SAMPLER_HALTON:
+		return &halton;
+	case SAMPLER_SOBOL:
+		return &sobol;
+	default:
+		return &independent;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Get a random float. Every thread has its own state, so we don't need to
+// lock everytime someone calls randf(). The state is aligned to a cache
+// line so that threads never share one. For the independent sampler we
+// use a PCG32 generator (see http://www.pcg-random.org) instead of
+// hashing every dimension.
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
+struct alignas(64) RandomState
+{
+	uint64_t state = 0x853c49e6748fea9bULL;
+	uint64_t inc = 0xda3e39cb94b95bdbULL;
+	uint32_t pixel = 0, sample_index = 0, dimension = 0;
+};
+static thread_local RandomState random_state;
+static SamplerType sampler_type = SAMPLER_INDEPENDENT;
+static Sampler* sampler = getSampler(SAMPLER_INDEPENDENT);
+
+static inline uint32_t pcg32(RandomState& rng)
+{
+	const uint64_t old_state = rng.state;
+	rng.state = old_state * 6364136223846793005ULL + rng.inc;
+	const uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+	const uint32_t rot = uint32_t(old_state >> 59u);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Choose the sampler used by all threads. Only call this between passes.
+///////////////////////////////////////////////////////////////////////////////
+void setSampler(SamplerType type)
+{
+	sampler_type = type;
+	sampler = getSampler(type);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start drawing numbers for a sample of a pixel at a given dimension
+///////////////////////////////////////////////////////////////////////////////
+void seedRandom(uint32_t pixel, uint32_t sample, uint32_t dimension)
+{
+	random_state.pixel = pixel;
+	random_state.sample_index = sample;
+	setRandomDimension(dimension);
+}
+
+void setRandomDimension(uint32_t dimension)
+{
+	random_state.dimension = dimension;
+	if(sampler_type == SAMPLER_INDEPENDENT)
+	{
+		const uint64_t seed = hash64((uint64_t(random_state.pixel) << 32) | random_state.sample_index);
+		random_state.state = 0;
+		random_state.inc = (hash64(seed ^ dimension) << 1u) | 1u;
+		pcg32(random_state);
+		random_state.state += seed;
+		pcg32(random_state);
+	}
+}
+
 float randf()
 {
-	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
+	if(sampler_type == SAMPLER_INDEPENDENT)
+	{
+		return toFloat(pcg32(random_state));
+	}
+	return sampler->sample(random_state.pixel, random_state.sample_index, random_state.dimension++);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -24,9 +280,14 @@ float randf()
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy)
 {
-	float r, theta;
 	float u1 = randf();
 	float u2 = randf();
+	concentricSampleDisk(u1, u2, dx, dy);
+}
+
+void concentricSampleDisk(float u1, float u2, float* dx, float* dy)
+{
+	float r, theta;
 	// Map uniform random numbers to $[-1,1]^2$
 	float sx = 2 * u1 - 1;
 	float sy = 2 * u2 - 1;
@@ -1,16 +1,99 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <cstdint>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Random number generation
+// The interface for any sampler. A sampler returns one dimension of one
+// sample of a pixel as a number in [0,1). Samplers hold no state, so one
+// sampler can be shared by all threads.
 ///////////////////////////////////////////////////////////////////////////
+class Sampler
+{
+public:
+	virtual ~Sampler(){};
+	virtual float sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Plain Monte Carlo, every dimension of every sample is independent
+///////////////////////////////////////////////////////////////////////////
+class IndependentSampler : public Sampler
+{
+public:
+	virtual float sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Jittered sampling. Pairs of dimensions are stratified on a grid with
+// samples_per_round cells (rounded down to a square), visited in a
+// random order per pixel and round.
+///////////////////////////////////////////////////////////////////////////
+class StratifiedSampler : public Sampler
+{
+public:
+	StratifiedSampler(uint32_t samples_per_round = 16);
+	virtual float sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override;
+
+private:
+	uint32_t m_strata; // Per dimension
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The Halton sequence (one prime base per dimension, for the first 140),
+// randomly shifted per pixel and dimension.
+///////////////////////////////////////////////////////////////////////////
+class HaltonSampler : public Sampler
+{
+public:
+	virtual float sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Owen-scrambled Sobol points. Pairs of dimensions use the first two
+// Sobol dimensions with independent scrambling and a shuffled sample
+// order, as described in "Practical Hash-based Owen Scrambling" (Burley,
+// JCGT 2020).
+///////////////////////////////////////////////////////////////////////////
+class SobolSampler : public Sampler
+{
+public:
+	virtual float sample(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override;
+};
+
+enum SamplerType
+{
+	SAMPLER_INDEPENDENT = 0,
+	SAMPLER_STRATIFIED,
+	SAMPLER_HALTON,
+	SAMPLER_SOBOL,
+	SAMPLER_COUNT
+};
+Sampler* getSampler(SamplerType type);
+
+///////////////////////////////////////////////////////////////////////////
+// Random number generation. Each thread draws its numbers from the
+// current sample: seedRandom() selects the pixel, the sample index and
+// the first dimension, after which every randf() returns the next
+// dimension of that sample from the active sampler. Since the numbers
+// only depend on (pixel, sample, dimension), images are independent of
+// thread count and tile order.
+//
+// With the independent sampler, randf() just steps a per-thread PCG32
+// generator that seedRandom() restarts at a sequence determined by
+// (pixel, sample, dimension).
+///////////////////////////////////////////////////////////////////////////
+void setSampler(SamplerType type);
+void seedRandom(uint32_t pixel, uint32_t sample, uint32_t dimension = 0);
+void setRandomDimension(uint32_t dimension);
 float randf();
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy);
+// Same, but maps the given uniform numbers u1, u2 in [0,1) to the disc
+void concentricSampleDisk(float u1, float u2, float* dx, float* dy);
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,126 @@
+#include "statistics.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace pathtracer
+{
+Statistics statistics;
+ThreadCounters thread_counters[MAX_STATISTICS_THREADS];
+static FILE* statistics_file = nullptr;
+static const char* counter_names[COUNTER_COUNT] = { "primary_rays", "shadow_rays", "secondary_rays",
+	                                                "brdf_evaluations", "escaped_rays", "cached_hits" };
+
+void PassStatistics::add(const PassStatistics& other)
+{
+	for(int c = 0; c < COUNTER_COUNT; c++)
+	{
+		counters[c] += other.counters[c];
+	}
+	for(int l = 0; l <= MAX_PATH_LENGTH; l++)
+	{
+		path_lengths[l] += other.path_lengths[l];
+	}
+	time += other.time;
+}
+
+const char* counterName(Counter counter)
+{
+	return counter_names[counter];
+}
+
+static void writeRow(const PassStatistics& pass)
+{
+	fprintf(statistics_file, "%d,%.6f,%.3f", statistics.passes, pass.time,
+	        pass.time > 0.0 ? pass.rays() / pass.time / 1e6 : 0.0);
+	for(int c = 0; c < COUNTER_COUNT; c++)
+	{
+		fprintf(statistics_file, ",%llu", (unsigned long long)pass.counters[c]);
+	}
+	for(int l = 0; l <= MAX_PATH_LENGTH; l++)
+	{
+		fprintf(statistics_file, ",%llu", (unsigned long long)pass.path_lengths[l]);
+	}
+	fprintf(statistics_file, "\n");
+}
+
+void endPass(double pass_time)
+{
+	const int num_threads = std::min(omp_get_max_threads(), MAX_STATISTICS_THREADS);
+	statistics.last_pass = PassStatistics();
+	statistics.last_pass_threads.assign(num_threads, PassStatistics());
+	for(int t = 0; t < MAX_STATISTICS_THREADS; t++)
+	{
+		// Counts of threads beyond num_threads (e.g. from an earlier pass
+		// with more threads) go to the last one
+		PassStatistics& thread = statistics.last_pass_threads[std::min(t, num_threads - 1)];
+		ThreadCounters& counters = thread_counters[t];
+		for(int c = 0; c < COUNTER_COUNT; c++)
+		{
+			thread.counters[c] += counters.counters[c];
+		}
+		for(int l = 0; l <= MAX_PATH_LENGTH; l++)
+		{
+			thread.path_lengths[l] += counters.path_lengths[l];
+		}
+		memset(&counters, 0, sizeof(counters));
+	}
+	for(auto& thread : statistics.last_pass_threads)
+	{
+		statistics.last_pass.add(thread);
+	}
+	statistics.last_pass.time = pass_time;
+	statistics.total.add(statistics.last_pass);
+	statistics.passes++;
+	if(statistics_file != nullptr)
+		writeRow(statistics.last_pass);
+}
+
+void discardPass()
+{
+	memset(thread_counters, 0, sizeof(thread_counters));
+}
+
+void resetStatistics()
+{
+	statistics.total = PassStatistics();
+	statistics.passes = 0;
+}
+
+bool openStatisticsFile(const string& filename)
+{
+	closeStatisticsFile();
+	statistics_file = fopen(filename.c_str(), "w");
+	if(statistics_file == nullptr)
+	{
+		cout << "Could not open " << filename << " for writing.\n";
+		return false;
+	}
+	fprintf(statistics_file, "pass,seconds,mrays_per_second");
+	for(int c = 0; c < COUNTER_COUNT; c++)
+	{
+		fprintf(statistics_file, ",%s", counterName(Counter(c)));
+	}
+	for(int l = 0; l <= MAX_PATH_LENGTH; l++)
+	{
+		fprintf(statistics_file, ",length_%d%s", l, l == MAX_PATH_LENGTH ? "_or_more" : "");
+	}
+	fprintf(statistics_file, "\n");
+	return true;
+}
+
+void closeStatisticsFile()
+{
+	if(statistics_file != nullptr)
+		fclose(statistics_file);
+	statistics_file = nullptr;
+}
+
+bool isStatisticsFileOpen()
+{
+	return statistics_file != nullptr;
+}
+} // namespace pathtracer
@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// What the integrators count while they trace paths
+///////////////////////////////////////////////////////////////////////////
+enum Counter
+{
+	COUNTER_PRIMARY_RAYS = 0,
+	COUNTER_SHADOW_RAYS,
+	COUNTER_SECONDARY_RAYS,
+	COUNTER_BRDF_EVALUATIONS, // Evaluated or sampled brdfs
+	COUNTER_ESCAPED_RAYS,     // Primary and secondary rays that hit nothing
+	COUNTER_CACHED_HITS,      // Camera rays found in the primary hit cache instead
+	COUNTER_COUNT
+};
+// The name of a counter, as used in the CSV header ("primary_rays", ...)
+const char* counterName(Counter counter);
+
+// The length of a path is the number of surfaces it hit. Paths this long
+// or longer share the last bin of the histogram.
+static const int MAX_PATH_LENGTH = 16;
+
+///////////////////////////////////////////////////////////////////////////
+// The counters of one pass (or the sum of several)
+///////////////////////////////////////////////////////////////////////////
+struct PassStatistics
+{
+	uint64_t counters[COUNTER_COUNT] = {};
+	uint64_t path_lengths[MAX_PATH_LENGTH + 1] = {};
+	double time = 0.0; // Wall-clock seconds
+	void add(const PassStatistics& other);
+	uint64_t rays() const
+	{
+		return counters[COUNTER_PRIMARY_RAYS] + counters[COUNTER_SHADOW_RAYS] + counters[COUNTER_SECONDARY_RAYS];
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The statistics of the last pass, per thread and merged, and of all
+// passes since the last restart()
+///////////////////////////////////////////////////////////////////////////
+extern struct Statistics
+{
+	PassStatistics last_pass;
+	std::vector<PassStatistics> last_pass_threads;
+	PassStatistics total;
+	int passes = 0;
+} statistics;
+
+///////////////////////////////////////////////////////////////////////////
+// Every thread counts into its own slot, on its own cache lines, without
+// atomics. endPass() merges the slots after the threads are done.
+///////////////////////////////////////////////////////////////////////////
+static const int MAX_STATISTICS_THREADS = 256;
+struct alignas(64) ThreadCounters
+{
+	uint64_t counters[COUNTER_COUNT];
+	uint64_t path_lengths[MAX_PATH_LENGTH + 1];
+};
+extern ThreadCounters thread_counters[MAX_STATISTICS_THREADS];
+
+inline void count(Counter counter, uint64_t n = 1)
+{
+	thread_counters[omp_get_thread_num() % MAX_STATISTICS_THREADS].counters[counter] += n;
+}
+inline void countPathLength(int length)
+{
+	const int bin = length < MAX_PATH_LENGTH ? length : MAX_PATH_LENGTH;
+	thread_counters[omp_get_thread_num() % MAX_STATISTICS_THREADS].path_lengths[bin]++;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Merge and clear the counters of all threads at the end of a pass that
+// took pass_time seconds. Also appends the pass to the CSV file, if one
+// is open.
+///////////////////////////////////////////////////////////////////////////
+void endPass(double pass_time);
+// Clear the counters of all threads without keeping them, when a pass
+// was cancelled
+void discardPass();
+// Forget all passes, on restart()
+void resetStatistics();
+
+///////////////////////////////////////////////////////////////////////////
+// Stream the statistics of every pass to a CSV file, one row per pass
+///////////////////////////////////////////////////////////////////////////
+bool openStatisticsFile(const std::string& filename);
+void closeStatisticsFile();
+bool isStatisticsFileOpen();
+} // namespace pathtracer
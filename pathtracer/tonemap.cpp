@@ -0,0 +1,122 @@
+#include "tonemap.h"
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The tonemapped values in [0, 1] are quantized to LUT_SIZE steps, and a
+// table turns the steps into 8-bit values. That is much cheaper than
+// evaluating pow() for sRGB. Near black, where the sRGB curve is steepest,
+// one step is still less than one 8-bit level.
+///////////////////////////////////////////////////////////////////////////
+static const int LUT_SIZE = 4096;
+// Pixels per job handed to a thread, a multiple of four
+static const int BLOCK_SIZE = 4096;
+
+struct EncodingTable
+{
+	uint8_t values[LUT_SIZE];
+	EncodingTable(bool srgb)
+	{
+		for(int i = 0; i < LUT_SIZE; i++)
+		{
+			const float x = float(i) / float(LUT_SIZE - 1);
+			float y = x;
+			if(srgb)
+				y = x <= 0.0031308f ? 12.92f * x : 1.055f * pow(x, 1.0f / 2.4f) - 0.055f;
+			values[i] = uint8_t(255.0f * y + 0.5f);
+		}
+	}
+};
+
+static inline float toneCurve(float x, ToneMapOperator op)
+{
+	if(op == TONEMAP_REINHARD)
+		return x / (1.0f + x);
+	if(op == TONEMAP_ACES)
+		return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+	return x;
+}
+
+static inline __m128 toneCurve(__m128 x, ToneMapOperator op)
+{
+	if(op == TONEMAP_REINHARD)
+		return _mm_div_ps(x, _mm_add_ps(_mm_set1_ps(1.0f), x));
+	if(op == TONEMAP_ACES)
+	{
+		const __m128 numerator = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+		const __m128 denominator = _mm_add_ps(
+		    _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+		return _mm_div_ps(numerator, denominator);
+	}
+	return x;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Scale, tonemap and quantize four channels. max() comes first, it
+// returns its second argument for NaN.
+///////////////////////////////////////////////////////////////////////////
+static inline __m128i quantize(__m128 x, __m128 scale, ToneMapOperator op)
+{
+	x = _mm_max_ps(_mm_mul_ps(x, scale), _mm_setzero_ps());
+	x = _mm_min_ps(toneCurve(x, op), _mm_set1_ps(1.0f));
+	return _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(float(LUT_SIZE - 1))));
+}
+
+static inline uint32_t pack(const uint8_t* table, const int32_t* steps)
+{
+	return uint32_t(table[steps[0]]) | uint32_t(table[steps[1]]) << 8 | uint32_t(table[steps[2]]) << 16
+	       | 0xff000000u;
+}
+
+void tonemap(const float* image, int num_pixels, const ToneMapping& tonemapping, uint32_t* result)
+{
+	static const EncodingTable srgb_table(true);
+	static const EncodingTable linear_table(false);
+	const uint8_t* table = tonemapping.srgb ? srgb_table.values : linear_table.values;
+	const ToneMapOperator op = tonemapping.op;
+	const float scale = exp2(tonemapping.exposure);
+	const __m128 scale4 = _mm_set1_ps(scale);
+
+	const int num_blocks = (num_pixels + BLOCK_SIZE - 1) / BLOCK_SIZE;
+#pragma omp parallel for schedule(dynamic)
+	for(int b = 0; b < num_blocks; b++)
+	{
+		const int first = b * BLOCK_SIZE;
+		const int last = std::min(first + BLOCK_SIZE, num_pixels);
+		int p = first;
+		///////////////////////////////////////////////////////////////////
+		// Four pixels are twelve floats, three SSE registers
+		///////////////////////////////////////////////////////////////////
+		for(; p + 4 <= last; p += 4)
+		{
+			const float* in = image + 3 * p;
+			alignas(16) int32_t steps[12];
+			_mm_store_si128((__m128i*)&steps[0], quantize(_mm_loadu_ps(in + 0), scale4, op));
+			_mm_store_si128((__m128i*)&steps[4], quantize(_mm_loadu_ps(in + 4), scale4, op));
+			_mm_store_si128((__m128i*)&steps[8], quantize(_mm_loadu_ps(in + 8), scale4, op));
+			result[p + 0] = pack(table, &steps[0]);
+			result[p + 1] = pack(table, &steps[3]);
+			result[p + 2] = pack(table, &steps[6]);
+			result[p + 3] = pack(table, &steps[9]);
+		}
+		// The last few pixels of the image
+		for(; p < last; p++)
+		{
+			int32_t steps[3];
+			for(int c = 0; c < 3; c++)
+			{
+				// Compared so that NaN goes to 0 and infinity to 1, like above
+				const float x = image[3 * p + c] * scale;
+				const float y = toneCurve(x > 0.0f ? x : 0.0f, op);
+				steps[c] = int32_t((y < 1.0f ? y : 1.0f) * float(LUT_SIZE - 1) + 0.5f);
+			}
+			result[p] = pack(table, steps);
+		}
+	}
+}
+} // namespace pathtracer
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// How radiance is squeezed into [0, 1] for display
+///////////////////////////////////////////////////////////////////////////
+enum ToneMapOperator
+{
+	TONEMAP_CLAMP = 0,
+	TONEMAP_REINHARD, // x / (1 + x)
+	TONEMAP_ACES,     // Narkowicz's fit of the ACES filmic curve
+};
+
+struct ToneMapping
+{
+	float exposure = 0.0f; // In stops, the image is scaled by 2^exposure
+	ToneMapOperator op = TONEMAP_CLAMP;
+	bool srgb = true; // Encode for an sRGB display, otherwise stay linear
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Tonemap an RGB float image to 8-bit RGBA, four channels at a time with
+// SSE and spread over the threads. The result is laid out like the
+// input, one pixel per uint32_t with red in the lowest byte (GL_RGBA,
+// GL_UNSIGNED_BYTE) and an alpha of 255. Negative and NaN values go to 0.
+///////////////////////////////////////////////////////////////////////////
+void tonemap(const float* image, int num_pixels, const ToneMapping& tonemapping, uint32_t* result);
+} // namespace pathtracer
@@ -0,0 +1,434 @@
+#include "wavefront.h"
+#include <algorithm>
+#include <vector>
+#include "Pathtracer.h"
+#include "Camera.h"
+#include "embree.h"
+#include "material.h"
+#include "sampling.h"
+#include "statistics.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// How many paths are in flight at the same time, and how many rays are
+// handed to embree in one call.
+///////////////////////////////////////////////////////////////////////////
+static const int WAVEFRONT_SIZE = 1 << 16;
+static const int WAVEFRONT_CHUNK = 256;
+
+///////////////////////////////////////////////////////////////////////////
+// The state of a set of paths, stored as one array per attribute so that
+// each stage only touches the data it needs. "path" is the index of the
+// path in the current wave and "pdf" the brdf pdf of the ray, 0 for camera
+// rays. For the shadow queue the "throughput" is the contribution the ray
+// adds if it is not occluded, and "path" its shadow slot (see shade()).
+///////////////////////////////////////////////////////////////////////////
+struct PathQueue
+{
+	vector<Ray> rays;
+	vector<vec3> throughput;
+	vector<float> pdf;
+	vector<int> path;
+	vector<char> active;
+	size_t size = 0;
+	void resize(size_t n)
+	{
+		size = n;
+		if(rays.size() < n)
+		{
+			rays.resize(n);
+			throughput.resize(n);
+			pdf.resize(n);
+			path.resize(n);
+			active.resize(n);
+		}
+	}
+	///////////////////////////////////////////////////////////////////////
+	// Move all active entries to the front of the arrays
+	///////////////////////////////////////////////////////////////////////
+	void compact()
+	{
+		size_t n = 0;
+		for(size_t i = 0; i < size; i++)
+		{
+			if(active[i])
+			{
+				rays[n] = rays[i];
+				throughput[n] = throughput[i];
+				pdf[n] = pdf[i];
+				path[n] = path[i];
+				n++;
+			}
+		}
+		size = n;
+	}
+};
+
+static PathQueue paths;
+static PathQueue shadow_rays;
+// The pixel, sample index and gathered radiance of each path in the wave,
+// and its first-hit features (while gatherFeatures())
+static vector<int> path_pixel;
+static vector<int> path_sample;
+static vector<vec3> radiance;
+static vector<PixelFeatures> features;
+// Whether the hit of each camera ray in the wave came from the cache
+static vector<char> cached;
+// For each path shaded in the current bounce, the path of the wave it
+// belongs to and the light its three shadow slots bring (zero if the ray
+// was occluded or not used). The shadow queue refers to the slots with
+// "path", so that after compact() each ray still knows where it goes.
+static vector<int> shaded_path;
+static vector<vec3> shadow_light;
+
+///////////////////////////////////////////////////////////////////////////
+// Intersect (or occlusion test) all rays of a queue, in chunks spread
+// over the threads. The rays are added to the given statistics counter.
+// Each chunk is a chance to pause, and cancelled passes skip the rest.
+// For camera rays, skip is set for the rays whose hits came from the
+// primary hit cache, and the time the others take is reported to it.
+///////////////////////////////////////////////////////////////////////////
+static void traceQueue(PathQueue& queue, bool shadow, bool coherent, Counter counter, const char* skip = nullptr)
+{
+	const int num_chunks = int((queue.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK);
+	pass_gate.leave();
+#pragma omp parallel
+	{
+		TeamGate team_gate(pass_gate);
+#pragma omp for schedule(dynamic) nowait
+		for(int c = 0; c < num_chunks; c++)
+		{
+			if(!pass_gate.checkpoint())
+				continue;
+			const size_t first = size_t(c) * WAVEFRONT_CHUNK;
+			const size_t count = std::min(size_t(WAVEFRONT_CHUNK), queue.size - first);
+			if(skip != nullptr)
+			{
+				// Trace the runs of rays that were not cached
+				const double start = omp_get_wtime();
+				size_t num_traced = 0;
+				for(size_t i = first; i < first + count;)
+				{
+					size_t end = i;
+					while(end < first + count && !skip[end])
+						end++;
+					if(end > i)
+						intersect(&queue.rays[i], end - i, coherent);
+					num_traced += end - i;
+					i = end + 1;
+				}
+				if(num_traced > 0)
+					primary_hit_cache.addTraceTime(omp_get_wtime() - start, num_traced);
+				pathtracer::count(counter, num_traced);
+				continue;
+			}
+			if(shadow)
+				occluded(&queue.rays[first], count, coherent);
+			else
+				intersect(&queue.rays[first], count, coherent);
+			pathtracer::count(counter, count);
+		}
+	}
+	pass_gate.enter();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Light samples of one thread in shade(), waiting until there are eight
+// of them to evaluate the brdf for at once. The shadow ray of each is
+// already queued, flush() fills in what it brings.
+///////////////////////////////////////////////////////////////////////////
+struct PendingLights
+{
+	MaterialBatch8 batch;
+	LightDirection directions[8];
+	int slots[8];
+	void add(int slot, const LightDirection& direction, const Intersection& hit)
+	{
+		const int l = batch.count++;
+		directions[l] = direction;
+		slots[l] = slot;
+		batch.material[l] = hit.material_index;
+		for(int k = 0; k < 3; k++)
+		{
+			batch.wi[k][l] = direction.wi[k];
+			batch.wo[k][l] = hit.wo[k];
+			batch.n[k][l] = hit.shading_normal[k];
+		}
+		if(batch.count == 8)
+			flush();
+	}
+	void flush()
+	{
+		if(batch.count == 0)
+			return;
+		evaluateMaterials8(batch);
+		for(int l = 0; l < batch.count; l++)
+		{
+			const vec3 brdf(batch.f[0][l], batch.f[1][l], batch.f[2][l]);
+			shadow_rays.throughput[slots[l]] = lightContribution(directions[l], brdf, batch.pdf[l]);
+		}
+		count(COUNTER_BRDF_EVALUATIONS, batch.count);
+		batch.count = 0;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Shade every path in the queue: add environment light for paths that
+// escaped, create shadow rays towards the light and the environment for
+// the ones that hit something, and sample a continuation ray if we are
+// allowed to bounce. Does the same as Li(), one stage at a time. Path i
+// owns shadow slots 3i to 3i + 2: the two light samples, and at the last
+// bounce the brdf sample, which only needs to know if it escapes. Pauses
+// and cancels like traceQueue().
+///////////////////////////////////////////////////////////////////////////
+static void shade(int bounce, bool last_bounce)
+{
+	shadow_rays.resize(3 * paths.size);
+	shaded_path.resize(paths.size);
+	shadow_light.resize(3 * paths.size);
+	const int num_chunks = int((paths.size + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK);
+	pass_gate.leave();
+#pragma omp parallel
+	{
+		TeamGate team_gate(pass_gate);
+#pragma omp for schedule(dynamic) nowait
+		for(int c = 0; c < num_chunks; c++)
+		{
+			if(!pass_gate.checkpoint())
+				continue;
+			PendingLights pending;
+			const int last = std::min((c + 1) * WAVEFRONT_CHUNK, int(paths.size));
+			for(int i = c * WAVEFRONT_CHUNK; i < last; i++)
+			{
+				Ray& r = paths.rays[i];
+				paths.active[i] = 0;
+				shaded_path[i] = paths.path[i];
+				for(int j = 0; j < 3; j++)
+				{
+					shadow_rays.active[3 * i + j] = 0;
+					shadow_light[3 * i + j] = vec3(0.0f);
+				}
+				if(r.geomID == RTC_INVALID_GEOMETRY_ID)
+				{
+					radiance[paths.path[i]] +=
+					    paths.throughput[i] * Lenvironment(r.d) * environmentMisWeight(paths.pdf[i], r.d);
+					count(COUNTER_ESCAPED_RAYS);
+					countPathLength(bounce);
+					continue;
+				}
+				const uint32_t dimension = RANDOM_PATH + bounce * RANDOM_DIMENSIONS_PER_BOUNCE;
+				seedRandom(path_pixel[paths.path[i]], path_sample[paths.path[i]], dimension);
+				Intersection hit = getIntersection(r);
+				const MaterialRecord& mat = material_table[hit.material_index];
+				radiance[paths.path[i]] += paths.throughput[i] * mat.emission * mat.color;
+
+				///////////////////////////////////////////////////////////////////
+				// Direct illumination, visibility is tested in the shadow stage
+				// and the brdf evaluated eight samples at a time
+				///////////////////////////////////////////////////////////////////
+				LightDirection directions[2];
+				const int num_directions = sampleLightDirections(hit, directions);
+				for(int j = 0; j < num_directions; j++)
+				{
+					shadow_rays.rays[3 * i + j] = directions[j].shadow_ray;
+					shadow_rays.path[3 * i + j] = 3 * i + j;
+					shadow_rays.active[3 * i + j] = 1;
+					directions[j].radiance *= paths.throughput[i];
+					pending.add(3 * i + j, directions[j], hit);
+				}
+
+				///////////////////////////////////////////////////////////////////
+				// Continue the path in a direction sampled from the brdf. At
+				// the last bounce, only see if it escapes to the environment.
+				///////////////////////////////////////////////////////////////////
+				vec3 wi;
+				float pdf;
+				vec3 brdf = materialSampleWi(mat, wi, hit.wo, hit.shading_normal, pdf);
+				count(COUNTER_BRDF_EVALUATIONS);
+				if(pdf <= 0.0f)
+				{
+					countPathLength(bounce + 1);
+					continue;
+				}
+				paths.throughput[i] *= brdf * std::abs(dot(wi, hit.shading_normal)) / pdf;
+				if(last_bounce && paths.throughput[i] != vec3(0.0f) && environment.multiplier > 0.0f)
+				{
+					shadow_rays.rays[3 * i + 2] = Ray(offsetRayOrigin(hit, wi), wi);
+					shadow_rays.throughput[3 * i + 2] =
+					    paths.throughput[i] * Lenvironment(wi) * environmentMisWeight(pdf, wi);
+					shadow_rays.path[3 * i + 2] = 3 * i + 2;
+					shadow_rays.active[3 * i + 2] = 1;
+				}
+				if(last_bounce || paths.throughput[i] == vec3(0.0f)
+				   || !russianRoulette(bounce, paths.throughput[i]))
+				{
+					countPathLength(bounce + 1);
+					continue;
+				}
+				r = Ray(offsetRayOrigin(hit, wi), wi);
+				paths.pdf[i] = pdf;
+				paths.active[i] = 1;
+			}
+			pending.flush();
+		}
+	}
+	pass_gate.enter();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add the contribution of every shadow ray that reached the light. The
+// rays of one path may be in different chunks of the compacted queue, so
+// each ray first puts its light in its own slot, and then each path adds
+// up its slots. No two threads ever add to the same path.
+///////////////////////////////////////////////////////////////////////////
+static void resolveShadows(int num_shaded)
+{
+	// shade() skipped some of the paths
+	if(pass_gate.cancelled())
+		return;
+#pragma omp parallel
+	{
+#pragma omp for schedule(dynamic, WAVEFRONT_CHUNK)
+		for(int i = 0; i < int(shadow_rays.size); i++)
+		{
+			if(shadow_rays.rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				shadow_light[shadow_rays.path[i]] = shadow_rays.throughput[i];
+			}
+		}
+#pragma omp for schedule(dynamic, WAVEFRONT_CHUNK)
+		for(int i = 0; i < num_shaded; i++)
+		{
+			radiance[shaded_path[i]] += shadow_light[3 * i] + shadow_light[3 * i + 1] + shadow_light[3 * i + 2];
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the samples of this pass (rendered_image.pass_samples for each
+// pixel), WAVEFRONT_SIZE paths at a time.
+///////////////////////////////////////////////////////////////////////////
+bool tracePathsWavefront(const Camera& camera)
+{
+	const int num_pixels = rendered_image.width * rendered_image.height;
+	int next_pixel = 0, next_sample = 0;
+	while(next_pixel < num_pixels)
+	{
+		if(!pass_gate.checkpoint())
+			return false;
+		///////////////////////////////////////////////////////////////////
+		// Pick the pixels for this wave, one path per sample. The samples
+		// of a pixel are numbered on from the count it had when the pass
+		// started. Only the first pixel of a wave can have samples of
+		// this pass accumulated already, by the previous wave.
+		///////////////////////////////////////////////////////////////////
+		path_pixel.clear();
+		path_sample.clear();
+		const int continued_pixel = next_pixel, continued_samples = next_sample;
+		while(next_pixel < num_pixels && int(path_pixel.size()) < WAVEFRONT_SIZE)
+		{
+			if(next_sample < rendered_image.pass_samples[next_pixel])
+			{
+				int first_sample = rendered_image.sample_count[next_pixel];
+				if(next_pixel == continued_pixel)
+					first_sample -= continued_samples;
+				path_pixel.push_back(next_pixel);
+				path_sample.push_back(first_sample + next_sample);
+				next_sample++;
+			}
+			else
+			{
+				next_pixel++;
+				next_sample = 0;
+			}
+		}
+		const int count = int(path_pixel.size());
+
+		///////////////////////////////////////////////////////////////////
+		// Generate: one camera ray per path
+		///////////////////////////////////////////////////////////////////
+		paths.resize(count);
+		radiance.assign(count, vec3(0.0f));
+		cached.resize(count);
+#pragma omp parallel for
+		for(int i = 0; i < count; i++)
+		{
+			const int x = path_pixel[i] % rendered_image.width, y = path_pixel[i] / rendered_image.width;
+			seedRandom(path_pixel[i], path_sample[i], RANDOM_CAMERA);
+			paths.rays[i] = camera.generateRay(x, y, cameraSample());
+			paths.throughput[i] = vec3(1.0f);
+			paths.pdf[i] = 0.0f;
+			paths.path[i] = i;
+			cached[i] = primary_hit_cache.lookup(path_pixel[i], path_sample[i], paths.rays[i]) ? 1 : 0;
+			if(cached[i])
+				pathtracer::count(COUNTER_CACHED_HITS);
+		}
+
+		for(int bounce = 0; bounce <= settings.max_bounces && paths.size > 0; bounce++)
+		{
+			if(!pass_gate.checkpoint())
+				return false;
+			///////////////////////////////////////////////////////////////
+			// Extend: find the closest hit for every path. Camera rays
+			// are coherent, everything after the first bounce is not.
+			// Camera rays with cached hits are not traced again.
+			///////////////////////////////////////////////////////////////
+			if(bounce == 0)
+			{
+				traceQueue(paths, false, true, COUNTER_PRIMARY_RAYS, cached.data());
+				// A cancelled pass skipped some of the rays
+				if(!pass_gate.cancelled())
+				{
+#pragma omp parallel for
+					for(int i = 0; i < count; i++)
+					{
+						if(!cached[i])
+							primary_hit_cache.store(path_pixel[i], path_sample[i], paths.rays[i]);
+					}
+				}
+			}
+			else
+			{
+				traceQueue(paths, false, false, COUNTER_SECONDARY_RAYS);
+			}
+			if(bounce == 0 && gatherFeatures())
+			{
+				features.resize(count);
+#pragma omp parallel for
+				for(int i = 0; i < count; i++)
+				{
+					features[i] = pixelFeatures(paths.rays[i]);
+				}
+			}
+			///////////////////////////////////////////////////////////////
+			// Shade: evaluate materials, queue shadow rays and pick
+			// continuation rays, then drop the paths that ended.
+			///////////////////////////////////////////////////////////////
+			const int num_shaded = int(paths.size);
+			shade(bounce, bounce == settings.max_bounces);
+			paths.compact();
+			shadow_rays.compact();
+			///////////////////////////////////////////////////////////////
+			// Shadow: test all shadow rays at once
+			///////////////////////////////////////////////////////////////
+			traceQueue(shadow_rays, true, false, COUNTER_SHADOW_RAYS);
+			resolveShadows(num_shaded);
+		}
+
+		// The image may have been resized while the stages were paused
+		if(pass_gate.cancelled())
+			return false;
+		for(int i = 0; i < count; i++)
+		{
+			rendered_image.accumulate(path_pixel[i], radiance[i]);
+			if(gatherFeatures())
+				rendered_image.accumulateFeatures(path_pixel[i], features[i]);
+		}
+	}
+	return true;
+}
+} // namespace pathtracer
@@ -0,0 +1,18 @@
+#pragma once
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+class Camera;
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the paths of one pass (rendered_image.pass_samples paths for
+// each pixel), advancing all paths one bounce at a time.
+// Each bounce runs as separate stages over queues of paths: extend
+// (intersect all rays), shade (evaluate the materials and pick the next
+// direction) and shadow (trace all shadow rays), until no paths are left
+// or settings.max_bounces is reached. Offers to pause between stages,
+// and returns false if the pass was cancelled (see PassGate).
+///////////////////////////////////////////////////////////////////////////
+bool tracePathsWavefront(const Camera& camera);
+} // namespace pathtracer